@@ -0,0 +1,108 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+/* the simulator as a library. all the state of a simulated machine is kept in a machine, so a program can run
+   any number of them, one after the other or side by side, without starting sim for each run.
+   build the library from sim.c without its main:
+       gcc -O2 -c -DSIM_LIBRARY sim.c -o machine.o
+   and link machine.o (with -pthread where needed) into the program that includes this file.
+   a run goes like sim's: machine_init, machine_load, optionally machine_open_output, machine_run_until (or
+   machine_step), machine_dump, and machine_free. a machine can be loaded again to run another program.
+   errors in the files terminate the program, as they do in sim */
+
+#define ENGINE_SWITCH 0                        /* execute_instruction, a switch over the opcode on every step (default) */
+#define ENGINE_THREADED 1                      /* run_threaded, jumps straight to a handler chosen when the word was decoded */
+#define ENGINE_JIT 2                           /* run_jit, translates basic blocks to x86-64 code. writes no trace */
+
+typedef struct machine machine;
+
+/* returns a new machine with empty memory and disk that runs with the given engine, skipping idle loops
+   if skip_idle_loops. returns NULL if there is no memory for it */
+machine* machine_init(int engine, int skip_idle_loops);
+
+/* resets the machine and loads memin, diskin and irq2in. the output files of the previous run are closed.
+   irq2in is read as the clock gets to its events, and can be a generator instead of a file: periodic:period[,first],
+   bursty:period,length[,spacing] or random:mean[,seed] */
+void machine_load(machine* m, char* memin_filename, char* diskin_filename, char* irq2in_filename);
+
+/* opens the files written while the program runs. without it they aren't written */
+void machine_open_output(machine* m, char* trace_filename, char* hwregtrace_filename, char* leds_filename,
+    char* display7seg_filename, int binary_trace, int async_output);
+
+/* writes what is left of the files opened by machine_open_output and closes them */
+void machine_close_output(machine* m);
+
+/* runs a single instruction (and the interrupt it may lead to). returns 1 iff the machine halted */
+int machine_step(machine* m);
+
+/* runs until the machine halts or its clock reaches clock_cycle_limit. it also stops, without halting, before
+   running anything at a PC outside main memory. returns 1 iff the machine halted */
+int machine_run_until(machine* m, int clock_cycle_limit);
+
+/* runs until the machine halts, its clock reaches clock_cycle_limit or it is about to run the instruction at PC.
+   returns 1 iff the machine halted */
+int machine_run_until_pc(machine* m, int PC, int clock_cycle_limit);
+
+/* writes the state of the machine to a snapshot file. returns 1 iff the machine halted */
+int machine_save_snapshot(machine* m, char* snapshot_filename);
+
+/* continues from a snapshot: its memory, disk, monitor, registers, clock and device state replace those of the
+   machine, which keeps the irq2 events it loaded. call it after machine_load */
+void machine_restore_snapshot(machine* m, char* snapshot_filename);
+
+/* counts the instructions, cycles, branches and calls of every PC from now on, and the cycles of every call path if
+   symbols_filename (the symbol map written by asm) isn't NULL. idle loops are run rather than skipped and the
+   JIT engine is replaced by the threaded engine. call it after machine_load */
+void machine_start_profile(machine* m, char* symbols_filename);
+
+/* writes the profile counted since machine_start_profile, and the folded stacks unless folded_filename is NULL */
+void machine_write_profile(machine* m, char* profile_filename, char* folded_filename);
+
+/* puts caches between the core and main memory, for instruction fetches if icache_spec isn't NULL and for lw and sw
+   if dcache_spec isn't NULL, given as sets,ways,line,policy,penalty (see -icache in sim.c). their misses add cycles
+   to the clock. idle loops are run rather than skipped and the JIT engine is replaced by the threaded engine.
+   returns 0, leaving the machine as it was, if a spec isn't valid */
+int machine_set_caches(machine* m, char* icache_spec, char* dcache_spec);
+
+/* writes the accesses and misses of the caches and the cycles the misses took */
+void machine_write_cache_stats(machine* m, char* stats_filename);
+
+/* times the program on a 5-stage pipeline from now on (see -pipeline in sim.c), next to the clock, which doesn't
+   change. idle loops are run rather than skipped and the JIT engine is replaced by the threaded engine */
+void machine_start_pipeline(machine* m);
+
+/* writes the cycles of the pipeline and their breakdown into stalls and flushes */
+void machine_write_pipeline_stats(machine* m, char* stats_filename);
+
+/* predicts every branch, jal and reti from now on with the predictor given as name or name,entries (see -predictor
+   in sim.c). a pipelined machine flushes only after its mispredictions. returns 0 if the spec isn't valid */
+int machine_start_predictor(machine* m, char* predictor_spec);
+
+/* writes the predictions and mispredictions of every control transfer and the cycles the mispredictions cost */
+void machine_write_predictor_stats(machine* m, char* stats_filename);
+
+/* sets how long the commands of the disk take from the next command on, given as overhead,seek,rotation,word[,dma]
+   (see -disktiming in sim.c). the default is a flat 1024 cycles. returns 0 if the spec isn't valid */
+int machine_set_disk_timing(machine* m, char* timing_spec);
+
+/* writes the pages of main memory and the monitor (64 words or pixels each) and the sectors of the disk that were
+   written since the program was loaded or restored, a line each (see -delta in sim.c) */
+void machine_write_delta(machine* m, char* delta_filename);
+
+/* writes memout, regout, cycles, diskout and monitor.txt, and the monitor image unless monitorimg_filename is NULL */
+void machine_dump(machine* m, char* memout_filename, char* regout_filename, char* cycles_filename,
+    char* diskout_filename, char* monitortxt_filename, char* monitorimg_filename);
+
+/* the state of the machine between instructions */
+int machine_halted(machine* m);
+int machine_pc(machine* m);
+int machine_clock_cycles(machine* m);
+long long machine_instructions(machine* m);
+int machine_register(machine* m, int reg_num);
+int machine_io_register(machine* m, int io_reg_num);
+int machine_memory_word(machine* m, int address);
+
+/* closes the output files and releases the machine */
+void machine_free(machine* m);
+
+#endif
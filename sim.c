@@ -5,6 +5,28 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#else
+#include <io.h>
+#endif
+#include <time.h>
+#ifndef _WIN32
+#define SIM_THREADS                            /* pthreads, for the output writer thread and the batch workers */
+#include <pthread.h>
+#include <sched.h>
+#ifndef __STDC_NO_ATOMICS__
+#define ASYNC_OUTPUT                           /* the output files are written by a writer thread */
+#include <stdatomic.h>
+#endif
+#endif
+#include "machine.h"
 
 /*************************************************/
 /**************** define constants ***************/
@@ -14,13 +36,46 @@
 #define NUM_OF_IO_REGISTERS 23                 /* number of input-output registers */
 #define MAIN_MEMORY_DEPTH 4096				   /* depth of main memory (0 to 4095) */
 #define MEMWORD_WIDTH_HEX 5                    /* width of a word in main and disk memory in hexadecimal digits */
+#define MEMWORD_MASK 0xfffff                   /* a word in main and disk memory is 20 bits wide */
 #define MONITOR_WIDTH_HEX 2                    /* width of a monitor pixel in hexadecimal digits */  
 #define MONITOR_PX_DIM 256                     /* monitor is 256x256 pixels */
+#define MONITOR_PIXELS (MONITOR_PX_DIM * MONITOR_PX_DIM) /* number of pixels in the monitor framebuffer */
 #define DISK_SECTORS 128                       /* the number of sectors in the disk */
 #define LINES_PER_SECTOR 128                   /* the number of lines for each sector in the disk memory */
-#define DISK_R_W_TIME 1024                     /* the number of clock cycles it takes for the disk to finish a read/write operation */
+#define DISK_R_W_TIME 1024                     /* the number of clock cycles it takes for the disk to finish a read/write operation (by default) */
+#define DISK_SECTORS_PER_TRACK 16              /* sectors around a track of the disk, for the rotational latency of -disktiming */
+#define DISK_TIMING_MAX (1 << 20)              /* limit of every cycle count in -disktiming */
+#define DISK_QUEUE_DEPTH 8                     /* commands that can wait in the queue of the disk (diskqueue) */
 #define MAX_LINE_SIZE 300                      /* max characters in a line of an input file */
+#define IRQ2_READ_AHEAD 1024                   /* irq2 events read (or generated) ahead of the clock */
+#define IRQ2_READ_BUFFER (1 << 16)             /* bytes of irq2in read at a time */
 #define MAX_OPCODE_NUM 21                      /* largest opcode number */
+#define OUTPUT_BUFFER_SIZE (1 << 20)           /* size of the buffers the output files are formatted into */
+#define OUTPUT_LINE_MAX 512                    /* room kept in an output buffer for the next line (or record) */
+#define TRACE_MAGIC "SIMTRACE"                 /* start of a binary trace file */
+#define HWREGTRACE_MAGIC "SIMHWREG"            /* start of a binary hwregtrace file */
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_RECORD_MAX_SIZE (6 + 4 * NUM_OF_REGISTERS)
+#define HWREGTRACE_RECORD_SIZE 9
+#define SNAPSHOT_MAGIC "SIMSNAP3"              /* start of a snapshot file */
+#define SNAPSHOT_MAGIC_SIZE 8
+
+/* when the snapshot of -snapshot is written, set by -snapshotat */
+#define SNAPSHOT_AT_HALT 0                     /* when the program halts (default) */
+#define SNAPSHOT_AT_CYCLE 1                    /* cycle:n, at the first instruction starting at clock n or later */
+#define SNAPSHOT_AT_PC 2                       /* pc:n, when the PC first reaches n */
+#define OUTPUT_RING_SIZE (1 << 16)             /* records in the ring of the output writer, a power of 2 */
+#define OUTPUT_RELEASE_BATCH 256               /* the writer thread frees ring entries this many at a time, a power of 2 */
+#define OUTPUT_THREAD_PAUSE_NS 50000           /* how long the writer thread sleeps when the ring is empty */
+
+/* variants of the handlers of the threaded engine. the handler of a decoded instruction is
+   HANDLERS_PER_OPCODE * opcode + variant, where invalid opcodes share the opcode MAX_OPCODE_NUM + 1 */
+#define HANDLER_REG 0                          /* without $imm */
+#define HANDLER_IMM 1                          /* with $imm */
+#define HANDLER_REG_NOP 2                      /* without $imm, and rd is a register the instruction can't change */
+#define HANDLER_IMM_NOP 3                      /* with $imm, and rd is a register the instruction can't change */
+#define HANDLERS_PER_OPCODE 4
+#define NUM_OF_HANDLERS (HANDLERS_PER_OPCODE * (MAX_OPCODE_NUM + 2))
 
 typedef int bool;
 #define true 1
@@ -58,10 +113,216 @@ typedef int bool;
 #define DISK_SECTOR 15
 #define DISK_BUFFER 16
 #define DISK_STATUS 17
+#define DISK_QUEUE 18
+#define DISK_DONE 19
 #define MONITOR_ADDR 20
 #define MONITOR_DATA 21
 #define MONITORCMD 22
 
+/* an instruction word of main memory after decoding its fields */
+typedef struct {
+    int opcode;
+    int rd, rs, rt;
+    bool is_immediate;  /* true iff one of rd, rs, rt is $imm */
+    int imm;            /* sign extended value of the next word, 0 if not is_immediate */
+    int handler;        /* handler of the instruction in the threaded engine */
+} decoded_instruction;
+
+/* a read or write command of the disk */
+typedef struct {
+    int command;                              /* READ or WRITE */
+    int sector, buffer;                       /* as written to disksector and diskbuffer */
+} disk_command;
+
+/* the commands given through diskqueue. they run one after the other, each starting in the cycle the one before it
+   finishes, and raise irq1 when they finish like a command given through diskcmd does */
+typedef struct {
+    disk_command commands[DISK_QUEUE_DEPTH];  /* a ring of the commands waiting to run, from head on */
+    int head, count;
+    bool running;                             /* true iff the running command came from the queue */
+    disk_command current;                     /* the running command if running, otherwise it is in the disk registers */
+} disk_queue;
+
+/* how long the commands of the disk take (-disktiming). the default is a flat DISK_R_W_TIME per command */
+typedef struct {
+    int overhead;                             /* cycles of every command */
+    int seek;                                 /* cycles per sector between the sector of the last command and this one */
+    int rotation;                             /* cycles of a turn of the disk, 0 for no rotational latency */
+    int word;                                 /* cycles of moving a word */
+    bool incremental;                         /* true iff the words move one by one as the command runs, not all at its end */
+} disk_timing;
+
+/* the disk. diskin is mapped into memory and each sector is parsed from it only when it is first used */
+typedef struct {
+    uint32_t words[DISK_SECTORS * LINES_PER_SECTOR];
+    bool resident[DISK_SECTORS];              /* true iff the sector was parsed from diskin or written, so words holds it */
+    char* image;                              /* the diskin file contents, NULL if the file is empty */
+    size_t image_size;
+    size_t sector_offsets[DISK_SECTORS + 1];  /* offset in image where the words of each sector start */
+    int indexed_sectors;                      /* sector_offsets is known for sectors 0 to indexed_sectors */
+    int timer;                                /* clock cycles the current read/write command has been running */
+    disk_queue queue;
+    disk_timing* timing;
+    int duration;                             /* clock cycles the current command takes */
+    int head_sector;                          /* the sector of the last command that started */
+    int words_moved;                          /* words of the current command that were already moved */
+    int read_address;                         /* where in main memory the last words read went */
+    int words_read;                           /* the number of words reads moved into main memory */
+} disk_image;
+
+/* an output file and the buffer its lines are formatted into. the buffer is written to the file with a single call
+   once the next line might not fit */
+typedef struct {
+    FILE* file;
+    char* buffer;
+    size_t used;
+} output_file;
+
+/* an output trace file, trace or hwregtrace. in binary mode (-trace binary) the trace is written as records that
+   tracedec turns back into the text files:
+   the file starts with TRACE_MAGIC or HWREGTRACE_MAGIC and all numbers are little endian.
+   a trace record is a 32 bit word with the instruction in bits 0-19 and PC in bits 20-31, a 16 bit mask of the
+   registers that changed since the previous record, and a 32 bit value for each of them (lowest register first).
+   a hwregtrace record is the 32 bit clock, a byte with the i/o register number * 2 + 1 for WRITE or + 0 for READ,
+   and the 32 bit value */
+typedef struct {
+    output_file file;
+    bool binary;
+    int registers[NUM_OF_REGISTERS];          /* registers as of the previous trace record */
+} trace_writer;
+
+/* kinds of lines written to the output files */
+#define OUTPUT_TRACE 0
+#define OUTPUT_HWREGTRACE_READ 1
+#define OUTPUT_HWREGTRACE_WRITE 2
+#define OUTPUT_LEDS 3
+#define OUTPUT_DISPLAY7SEG 4
+
+/* a line of trace, hwregtrace, leds or display7seg before it is formatted */
+typedef struct {
+    int type;
+    union {
+        struct {
+            int PC;
+            uint32_t instruction;
+            int registers[NUM_OF_REGISTERS];
+        } trace;
+        struct {
+            int clock_cycle_counter;
+            int io_reg_num;
+            int value;
+        } io;                                 /* hwregtrace, leds and display7seg */
+    } data;
+} output_record;
+
+/* the files written while the program runs, and the ring of records on their way to them.
+   the simulation is the only one to push records and the writer thread the only one to write them */
+typedef struct {
+    trace_writer trace_file, hwregtrace_file;
+    output_file leds_file, display7seg_file;
+    bool trace_enabled;                       /* false when no trace is written (the JIT engine) */
+    output_record* ring;
+    unsigned pushed;                          /* number of records pushed so far */
+    unsigned written;                         /* number of records known to be written */
+    bool async;                               /* true iff the writer thread is running */
+#ifdef ASYNC_OUTPUT
+    atomic_uint pushed_index, written_index;  /* pushed and written as shared with the writer thread */
+    atomic_bool done;                         /* set when the simulation pushed its last record */
+    pthread_t thread;
+#endif
+} output_writer;
+
+/* irq2in as it is read, a part at a time. the numbers are read from token on and the lines from offset on, apart
+   from each other (see read_irq2_event), so text holds the file from whichever of them is first */
+typedef struct {
+    FILE* file;
+    char* filename;
+    char* text;                               /* the part of the file read so far, from start on */
+    size_t size, capacity;                    /* bytes in text, and its size (IRQ2_READ_BUFFER unless a line holds many numbers) */
+    long long start;                          /* offset in the file of text[0] */
+    bool end;                                 /* true once the whole file is in text */
+    long long offset, token;                  /* offsets in the file of the next line and the next number */
+    int line;                                 /* number of the line at offset, from 1 */
+    bool scanning;                            /* false once a line didn't start with a number: the rest are 0 */
+    bool reported;                            /* true once a malformed line was reported */
+} irq2_reader;
+
+/* where the irq2 events come from */
+#define IRQ2_ARRAY 0                          /* an array that the caller keeps (the inputs of -fuzz) */
+#define IRQ2_FILE 1                           /* irq2in, read as the clock gets to its events */
+#define IRQ2_GENERATOR 2                      /* a generator given instead of irq2in */
+
+/* kinds of irq2 generators (see parse_irq2_generator) */
+#define IRQ2_PERIODIC 0
+#define IRQ2_BURSTY 1
+#define IRQ2_RANDOM 2
+
+typedef struct {
+    int kind;
+    int period, first;                        /* periodic and bursty: the first event (burst) and the cycles between them */
+    int length, spacing;                      /* bursty: events in a burst, and the cycles between them */
+    int mean;                                 /* random: the mean of the cycles between events */
+    uint64_t seed, state;                     /* random: the xorshift64* generator of the cycles between events */
+    long long cycle;                          /* the next event, or the start of the next burst */
+    int index;                                /* bursty: the events of the current burst made so far */
+} irq2_generator;
+
+/* the clock cycles in which irq2status is raised: the next IRQ2_READ_AHEAD of them, read from irq2in or made by a
+   generator as the clock gets to them, or all of them for an array */
+typedef struct {
+    int* cycles;
+    int count;
+    int next;                                 /* index in cycles of the next time irq2status will be raised */
+    int raised;                               /* number of times irq2status was raised so far */
+    int source;                               /* IRQ2_ARRAY, IRQ2_FILE or IRQ2_GENERATOR */
+    irq2_reader* reader;                      /* irq2in, for IRQ2_FILE */
+    irq2_generator generator;                 /* for IRQ2_GENERATOR */
+} irq2_events;
+
+/* events of the devices, the next of each is kept in the device scheduler */
+#define EVENT_IRQ2 0                          /* irq2in raises irq2status */
+#define EVENT_DISK 1                          /* the disk finishes a read/write command */
+#define EVENT_TIMER 2                         /* timercurrent reaches timermax */
+#define EVENT_IO 3                            /* a reti, in or out instruction may have changed the devices or the interrupts */
+#define NUM_OF_EVENTS 4
+#define NO_EVENT INT32_MAX                    /* the cycle of an event that won't happen */
+
+/* binary heap of the cycles of the next events */
+typedef struct {
+    int cycles[NUM_OF_EVENTS];
+    int events[NUM_OF_EVENTS];
+    int positions[NUM_OF_EVENTS];             /* index of each event in the heap */
+    int synced_clock_cycle_counter;           /* clock up to which timercurrent, the disk timer and clockcyclecounter were updated */
+} device_scheduler;
+
+#define IDLE_LOOP_MAX_CYCLES 256               /* longest iteration of a polling loop that is skipped */
+
+/* the iteration of a polling loop that is running, and the state when it started */
+typedef struct {
+    bool enabled;                             /* false to run idle loops instead of skipping them (-idleloops run) */
+    bool armed;                               /* true if an iteration started and no sw or out ran since */
+    int PC;                                   /* address of the in instruction that started the iteration */
+    int clock_cycle_counter;
+    long long instructions;                   /* number of instructions run when the iteration started */
+    unsigned first_record;                    /* number of records pushed to the output when the iteration started */
+    int registers[NUM_OF_REGISTERS];
+    int io_registers[NUM_OF_IO_REGISTERS];
+    bool executing_ISR;
+    int irq2_raised;
+} idle_loop_detector;
+
+/* bitmaps of the words of main memory, the sectors of the disk and the pixels of the monitor written since they
+   were last cleared. fuzzing (-fuzz) resets only what they mark between runs, and -delta writes only what they mark.
+   the high-water marks aren't cleared with the bitmaps, so the final dumps only look for the last non-zero word below them */
+typedef struct {
+    uint64_t memory[MAIN_MEMORY_DEPTH / 64];
+    uint64_t sectors[(DISK_SECTORS + 63) / 64];
+    uint64_t monitor[MONITOR_PIXELS / 64];
+    int memory_end;                           /* no word of main memory from here on was ever non-zero */
+    int monitor_end;                          /* no pixel of the monitor from here on was ever non-zero */
+} dirty_map;
+#define DIRTY_MARK(bitmap, index) ((bitmap)[(index) >> 6] |= (uint64_t)1 << ((index) & 63))
+
 /*************************************************/
 /***************** functions *********************/
 /*************************************************/
@@ -85,6 +346,122 @@ int empty_line_check(char* line) {
     return 1;
 }
 
+/* calculates a (mod b) for b > 0 */
+int mod(int a, int b) {
+    int result;
+    result = a % b;
+    if (result < 0) { /* a negative multiple of b gives 0, not b */
+        result += b;
+    }
+    return result;
+}
+
+/* converts a string of a number in hexadecimal to a word of main or disk memory.
+   If it is larger than 20 bits only the lower 20 bits are used. */
+uint32_t hex_to_mem_word(char* num_hex) {
+    return (uint32_t)strtoul(num_hex, NULL, 16) & MEMWORD_MASK;
+}
+
+/* decodes a word of exactly 5 hex digits, the way nearly every word of memin and diskin is written, without going
+   through strtoul: the 5 characters are checked and converted together as the bytes of a 64 bit integer. returns
+   false if text doesn't start with 5 hex digits, and then the caller parses the word with hex_to_mem_word. the
+   caller makes sure 5 characters can be read */
+bool decode_hex_word(const char* text, uint32_t* word) {
+    const uint64_t ones = 0x0101010101, high = 0x8080808080;
+    uint64_t x = 0, lower, digits, letters, nibbles;
+    int i;
+
+    for (i = 4; i >= 0; i--) { /* text[i] is byte i, whatever the byte order of the machine */
+        x = (x << 8) | (unsigned char)text[i];
+    }
+    if ((x & high) != 0) {
+        return false;
+    }
+    /* adding 0x80 - c to a byte below 0x80 sets its high bit iff it is at least c, without a carry into the next byte */
+    digits = (x + 0x50 * ones) & ~(x + 0x46 * ones) & high;              /* '0' to '9' */
+    lower = x | 0x20 * ones;
+    letters = (lower + 0x1f * ones) & ~(lower + 0x19 * ones) & high;     /* 'a' to 'f' and 'A' to 'F' */
+    if ((digits | letters) != high) {
+        return false;
+    }
+    nibbles = (x & 0x0f * ones) + (letters >> 7) * 9;
+    *word = (uint32_t)(((nibbles & 0xf) << 16) | ((nibbles >> 8 & 0xf) << 12) | ((nibbles >> 16 & 0xf) << 8) |
+        ((nibbles >> 24 & 0xf) << 4) | (nibbles >> 32 & 0xf));
+    return true;
+}
+
+/* returns true iff a (non-empty) line of memin is a single hex number, with nothing but whitespace around it */
+bool hex_line_check(char* line) {
+    char* end;
+    line += strspn(line, " \t\r\n\v\f");
+    if (!isxdigit((unsigned char)line[0])) {
+        return false;
+    }
+    strtoul(line, &end, 16);
+    return empty_line_check(end) == 1;
+}
+
+/* returns true iff a (non-empty) line of irq2in is a single decimal number, with nothing but whitespace around it */
+bool decimal_line_check(char* line) {
+    char* end;
+    line += strspn(line, " \t\r\n\v\f");
+    if (!isdigit((unsigned char)line[line[0] == '-' || line[0] == '+'])) {
+        return false;
+    }
+    strtol(line, &end, 10);
+    return empty_line_check(end) == 1;
+}
+
+/* reads a whole input file into memory with a single call (or maps it), and stores its size in *size.
+   returns NULL for an empty file. the caller releases it with unmap_input_file */
+char* map_input_file(char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    char* text = NULL;
+    open_file_check(filename, file);
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    if (*size > 0) {
+#ifdef _WIN32
+        /* no mmap, read the whole file with a single call instead */
+        text = malloc(*size);
+        rewind(file);
+        if (text == NULL || fread(text, 1, *size, file) != *size) {
+            open_file_check(filename, NULL);
+        }
+#else
+        text = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (text == MAP_FAILED) {
+            open_file_check(filename, NULL);
+        }
+#endif
+    }
+    fclose(file);
+    return text;
+}
+
+void unmap_input_file(char* text, size_t size) {
+    if (text != NULL) {
+#ifdef _WIN32
+        free(text);
+#else
+        munmap(text, size);
+#endif
+    }
+}
+
+/* the end of the line of text starting at offset, where fgets with a MAX_LINE_SIZE + 1 buffer would stop: after the
+   newline, or after MAX_LINE_SIZE characters of a longer line. the line is copied to line_buffer as fgets would */
+size_t read_input_line(char* text, size_t size, size_t offset, char* line_buffer) {
+    size_t limit = size - offset > MAX_LINE_SIZE ? offset + MAX_LINE_SIZE : size;
+    char* newline = memchr(&text[offset], '\n', limit - offset);
+    size_t end = newline != NULL ? (size_t)(newline - text) + 1 : limit;
+
+    memcpy(line_buffer, &text[offset], end - offset);
+    line_buffer[end - offset] = '\0';
+    return end;
+}
+
 /**************************************************************/
 /******************* initialize data structures ***************/
 /**************************************************************/
@@ -92,106 +469,574 @@ int empty_line_check(char* line) {
 /* 
 Initialize main memory by reading lines from memin_filename. If memin_filename has fewer than 4096
 lines the rest is initialized to 0.
-main_memory should point to a MAIN_MEMORY_DEPTH entries long array of char pointers. The caller must free() the lines
-in main_memory which are allocated by this function.
+main_memory should point to a MAIN_MEMORY_DEPTH entries long array of words.
 */
-void initialize_main_memory(char** main_memory, char* memin_filename) {
-    int i = 0, num_of_lines = 0;
-    FILE* memin_file = NULL;
+int initialize_main_memory(uint32_t* main_memory, char* memin_filename) {
+    int i = 0, line = 1, malformed_line = 0, length;
+    size_t size, offset = 0;
+    char* text = map_input_file(memin_filename, &size);
     char line_buffer[MAX_LINE_SIZE + 1];
-    memin_file = fopen(memin_filename, "r");
-    open_file_check(memin_filename, memin_file);
-    
-    /* count the number of instructions and data in the file 
+
+    /* fill the main_memory array with the non-empty lines of the file, in a single pass over it
        if we have more lines than the defined maximum we will ignore the last lines */
-    while (fgets(line_buffer, MAX_LINE_SIZE + 1, memin_file) && num_of_lines <= MAIN_MEMORY_DEPTH) {
-        if (empty_line_check(line_buffer) != 1) { // if the line is not empty add 1 to num_of_lines 
-            num_of_lines++;
+    while (i < MAIN_MEMORY_DEPTH && offset < size) {
+        /* a line of 5 hex digits is decoded right where it is */
+        length = size - offset < 6 ? 0 : text[offset + 5] == '\n' ? 6 :
+            text[offset + 5] == '\r' && size - offset >= 7 && text[offset + 6] == '\n' ? 7 : 0;
+        if (length != 0 && decode_hex_word(&text[offset], &main_memory[i])) {
+            i++;
+            line++;
+            offset += length;
+            continue;
         }
-    }
-    /* reset file pointer after counting */
-    rewind(memin_file); 
-    
-    /* fill the main_memory array */
-    for (i = 0; i < MAIN_MEMORY_DEPTH; i++) {
-        main_memory[i] = calloc(MEMWORD_WIDTH_HEX + 1, sizeof(char));
-        /* fill main_memory with non-ziroes lines */
-        if(i < num_of_lines) { 
-            fscanf(memin_file, "%s\n", main_memory[i]);
+        offset = read_input_line(text, size, offset, line_buffer);
+        if (empty_line_check(line_buffer) != 1) {
+            main_memory[i++] = hex_to_mem_word(line_buffer);
+            if (malformed_line == 0 && !hex_line_check(line_buffer)) {
+                malformed_line = line;
+            }
         }
-        /* if(i >= num_of_lines) fill main_memory with ziroes lines */
-        else { 
-            strcpy(main_memory[i], "00000");
+        if (text[offset - 1] == '\n') {
+            line++;
         }
     }
-    fclose(memin_file);
+    /* fill the rest of main_memory with ziroes */
+    memset(&main_memory[i], 0, (MAIN_MEMORY_DEPTH - i) * sizeof(uint32_t));
+    unmap_input_file(text, size);
+    if (malformed_line != 0) { /* it is read as strtoul reads it, like it always was */
+        fprintf(stderr, "Malformed Line %d In File %s\n", malformed_line, memin_filename);
+    }
+    return i; /* the number of words read */
+}
+
+/* create monitor as a 256*256 framebuffer of one byte per pixel. initially all the pixels are black
+monitor should point to a MONITOR_PIXELS entries long array of bytes. */
+void initialize_monitor(uint8_t* monitor) {
+    memset(monitor, 0, MONITOR_PIXELS); /* default pixel brightness is zero (which is black) */
+    return;
+}
+
+/* initialize disk (diskin) by mapping the diskin file into memory. No sector is parsed here,
+   see load_disk_sector. The caller must release the mapping with free_disk. */
+void initialize_disk(disk_image* disk, char* diskin_filename) {
+    disk->image = map_input_file(diskin_filename, &disk->image_size);
+
+    memset(disk->resident, 0, sizeof(disk->resident));
+    disk->sector_offsets[0] = 0;
+    disk->indexed_sectors = 0;
+    disk->timer = 0;
+    memset(&disk->queue, 0, sizeof(disk->queue));
+    disk->duration = DISK_R_W_TIME;
+    disk->head_sector = 0;
+    disk->words_moved = 0;
     return;
 }
 
-/* create monitor as string array of size 256*256. initially all the pixels are black
-monitor should point to a MONITOR_PX_DIM * MONITOR_PX_DIM entries long array of char pointers.
-The caller must free() the pixel strings which are allocated by this function. */
-void initialize_monitor(char** monitor) {
+/* returns the offset in the disk image of the word after the word starting at offset (or at the whitespace before it).
+   like fscanf("%s") in the original loader, words are separated by any whitespace */
+size_t skip_disk_image_word(disk_image* disk, size_t offset) {
+    while (offset < disk->image_size && isspace((unsigned char)disk->image[offset])) {
+        offset++;
+    }
+    while (offset < disk->image_size && !isspace((unsigned char)disk->image[offset])) {
+        offset++;
+    }
+    return offset;
+}
+
+/* makes sure the given sector of the disk is resident in disk->words by parsing it from the disk image
+   if this wasn't done before. words missing from the end of the image are zero. returns the sector's words */
+uint32_t* load_disk_sector(disk_image* disk, int sector) {
+    uint32_t* words = &disk->words[LINES_PER_SECTOR * sector];
+    char word_buffer[MAX_LINE_SIZE + 1];
+    size_t offset, word_end;
     int i;
-    for (i = 0; i < MONITOR_PX_DIM * MONITOR_PX_DIM; i++) {
-        monitor[i] = calloc(MONITOR_WIDTH_HEX + 1, sizeof(char));
-        strcpy(monitor[i], "00"); /* default pixel brightness is zero = "00" (which is black) */
+
+    if (disk->resident[sector]) {
+        return words;
     }
-    return;
+    /* find where the sector starts by skipping over the words of the sectors before it (without parsing them) */
+    while (disk->indexed_sectors < sector) {
+        offset = disk->sector_offsets[disk->indexed_sectors];
+        for (i = 0; i < LINES_PER_SECTOR; i++) {
+            offset = skip_disk_image_word(disk, offset);
+        }
+        disk->sector_offsets[++disk->indexed_sectors] = offset;
+    }
+
+    offset = disk->sector_offsets[sector];
+    for (i = 0; i < LINES_PER_SECTOR; i++) {
+        word_end = skip_disk_image_word(disk, offset);
+        while (offset < word_end && isspace((unsigned char)disk->image[offset])) {
+            offset++;
+        }
+        if (offset == word_end) { /* end of the image */
+            break;
+        }
+        if (word_end - offset == 5 && decode_hex_word(&disk->image[offset], &words[i])) {
+            offset = word_end;
+            continue;
+        }
+        if (word_end - offset > MAX_LINE_SIZE) {
+            word_end = offset + MAX_LINE_SIZE;
+        }
+        memcpy(word_buffer, &disk->image[offset], word_end - offset);
+        word_buffer[word_end - offset] = '\0';
+        words[i] = hex_to_mem_word(word_buffer);
+        offset = skip_disk_image_word(disk, offset);
+    }
+    memset(&words[i], 0, (LINES_PER_SECTOR - i) * sizeof(uint32_t));
+    if (disk->indexed_sectors == sector) {
+        disk->sector_offsets[++disk->indexed_sectors] = offset;
+    }
+    disk->resident[sector] = true;
+    return words;
 }
 
-/* initialize disk (diskin), Loading the data from the diskin file
-   the disk representing the data as array of strings
-   disk should point to a DISK_SECTORS * LINES_PER_SECTOR entries long array of char pointers. The caller must free() the lines
-   in disk which are allocated by this function.*/
-void initialize_disk(char** disk, char* diskin_filename) {
-    int i = 0;
-    char line_buffer[MAX_LINE_SIZE + 1];
-    FILE* diskin_file = NULL;
-    diskin_file = fopen(diskin_filename, "r");
-    open_file_check(diskin_filename, diskin_file);
+/* marks the given sector as resident without parsing it from the disk image, for when it is about to be fully overwritten.
+   returns the sector's words */
+uint32_t* overwrite_disk_sector(disk_image* disk, int sector) {
+    disk->resident[sector] = true;
+    return &disk->words[LINES_PER_SECTOR * sector];
+}
 
-    /* create disk array */
-    for (i = 0; i < DISK_SECTORS * LINES_PER_SECTOR; i++) {
-        disk[i] = calloc(MEMWORD_WIDTH_HEX + 1, sizeof(char));
-        strcpy(disk[i], "00000"); 
+/* parses overhead,seek,rotation,word with an optional ,dma at the end for incremental transfers. returns false if
+   it isn't valid */
+bool parse_disk_timing(char* spec, disk_timing* timing) {
+    int length = 0;
+
+    if (sscanf(spec, "%d,%d,%d,%d%n", &timing->overhead, &timing->seek, &timing->rotation, &timing->word, &length) != 4) {
+        return false;
     }
-    /* fill disk with the data from the diskin file */
-    for (i = 0; i < DISK_SECTORS * LINES_PER_SECTOR; i++) {
-        fscanf(diskin_file, "%s\n", disk[i]);
+    timing->incremental = strcmp(&spec[length], ",dma") == 0;
+    if (spec[length] != '\0' && !timing->incremental) {
+        return false;
+    }
+    return timing->overhead >= 0 && timing->overhead <= DISK_TIMING_MAX && timing->seek >= 0 && timing->seek <= DISK_TIMING_MAX &&
+        timing->rotation >= 0 && timing->rotation <= DISK_TIMING_MAX && timing->word >= 0 && timing->word <= DISK_TIMING_MAX;
+}
+
+/* the timing of the disk before -disktiming, a flat DISK_R_W_TIME for every command */
+void default_disk_timing(disk_timing* timing) {
+    timing->overhead = DISK_R_W_TIME;
+    timing->seek = 0;
+    timing->rotation = 0;
+    timing->word = 0;
+    timing->incremental = false;
+}
+
+/* starts timing a command on the given sector, which the disk starts at clock_cycle_counter. it takes the overhead,
+   a seek from the sector of the last command, the rotational latency until the sector comes under the head (the
+   disk turns once every rotation cycles, with the sectors of a track evenly spaced around it) and the words */
+void start_disk_timing(disk_image* disk, int sector, int clock_cycle_counter) {
+    disk_timing* timing = disk->timing;
+    long long cycles, position, angle;
+
+    sector = mod(sector, DISK_SECTORS);
+    cycles = timing->overhead + (long long)timing->seek * abs(sector - disk->head_sector);
+    if (timing->rotation > 0) {
+        position = (long long)(sector % DISK_SECTORS_PER_TRACK) * timing->rotation / DISK_SECTORS_PER_TRACK;
+        angle = ((long long)clock_cycle_counter + cycles) % timing->rotation;
+        cycles += (position - angle + timing->rotation) % timing->rotation;
+    }
+    cycles += (long long)timing->word * LINES_PER_SECTOR;
+    disk->duration = (int)cycles;
+    disk->head_sector = sector;
+    disk->words_moved = 0;
+    disk->timer = 0;
+}
+
+/* the value of the disk timer at which disk_check has to run next: when the command finishes or, with incremental
+   transfers, when its next word has moved. the words move during the last cycles of the command, one every word cycles */
+int disk_event_time(disk_image* disk) {
+    if (disk->timing->incremental && disk->words_moved < LINES_PER_SECTOR) {
+        return disk->duration - (LINES_PER_SECTOR - 1 - disk->words_moved) * disk->timing->word;
+    }
+    return disk->duration;
+}
+
+/* starts the command at the head of the queue of the disk, which must be free */
+void start_queued_disk_command(disk_image* disk, int* io_registers, int clock_cycle_counter) {
+    disk->queue.current = disk->queue.commands[disk->queue.head];
+    disk->queue.head = (disk->queue.head + 1) % DISK_QUEUE_DEPTH;
+    disk->queue.count--;
+    disk->queue.running = true;
+    start_disk_timing(disk, disk->queue.current.sector, clock_cycle_counter);
+    io_registers[DISKCMD] = disk->queue.current.command;
+    io_registers[DISK_STATUS] = BUSY;
+    io_registers[DISK_QUEUE] = disk->queue.count;
+}
+
+/* queues the command written to diskqueue (READ or WRITE) with the current disksector and diskbuffer, which may
+   change right after, and starts it if the disk is free. a command that doesn't fit in the queue is dropped.
+   diskqueue then holds the number of commands waiting */
+void disk_enqueue(disk_image* disk, int* io_registers, int clock_cycle_counter) {
+    disk_command* command;
+    int command_num = io_registers[DISK_QUEUE];
+
+    if ((command_num == READ || command_num == WRITE) && disk->queue.count < DISK_QUEUE_DEPTH) {
+        command = &disk->queue.commands[(disk->queue.head + disk->queue.count) % DISK_QUEUE_DEPTH];
+        command->command = command_num;
+        command->sector = io_registers[DISK_SECTOR];
+        command->buffer = io_registers[DISK_BUFFER];
+        disk->queue.count++;
+        if (io_registers[DISK_STATUS] == FREE) {
+            start_queued_disk_command(disk, io_registers, clock_cycle_counter);
+        }
+    }
+    io_registers[DISK_QUEUE] = disk->queue.count;
+}
+
+/* releases the disk image mapped by initialize_disk */
+void free_disk(disk_image* disk) {
+    unmap_input_file(disk->image, disk->image_size);
+}
+
+/* reads the next number of text from *token on the way fscanf("%d") does: skips whitespace and reads an optional
+   sign and digits. sets *scanning to false, and returns 0, if there is no number there */
+int scan_decimal_token(char* text, size_t size, size_t* token, bool* scanning) {
+    char number[MAX_LINE_SIZE + 1];
+    size_t start, end;
+
+    while (*token < size && isspace((unsigned char)text[*token])) {
+        (*token)++;
+    }
+    start = *token;
+    end = start < size && (text[start] == '-' || text[start] == '+') ? start + 1 : start;
+    if (end >= size || !isdigit((unsigned char)text[end])) {
+        *scanning = false;
+        return 0;
+    }
+    while (end < size && isdigit((unsigned char)text[end])) {
+        end++;
+    }
+    *token = end;
+    if (end - start > MAX_LINE_SIZE) { /* too long to be anything but out of range anyway */
+        end = start + MAX_LINE_SIZE;
+    }
+    memcpy(number, &text[start], end - start);
+    number[end - start] = '\0';
+    return (int)strtol(number, NULL, 10);
+}
+
+/* the next number of a xorshift64* generator */
+uint32_t fuzz_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/* starts reading irq2in over from its start */
+void rewind_irq2_reader(irq2_reader* reader) {
+    rewind(reader->file);
+    reader->size = 0;
+    reader->start = 0;
+    reader->end = false;
+    reader->offset = 0;
+    reader->token = 0;
+    reader->line = 1;
+    reader->scanning = true;
+}
+
+/* opens irq2in to be read from its start by read_irq2_event */
+irq2_reader* open_irq2_reader(char* irq2in_filename) {
+    irq2_reader* reader = malloc(sizeof(irq2_reader));
+    if (reader == NULL || (reader->text = malloc(IRQ2_READ_BUFFER)) == NULL ||
+        (reader->filename = malloc(strlen(irq2in_filename) + 1)) == NULL) {
+        printf("An Error Has Occurred With File %s\n", irq2in_filename);
+        exit(1);
+    }
+    strcpy(reader->filename, irq2in_filename);
+    reader->file = fopen(irq2in_filename, "rb");
+    open_file_check(irq2in_filename, reader->file);
+    reader->capacity = IRQ2_READ_BUFFER;
+    reader->reported = false;
+    rewind_irq2_reader(reader);
+    return reader;
+}
+
+void close_irq2_reader(irq2_reader* reader) {
+    if (reader != NULL) {
+        fclose(reader->file);
+        free(reader->text);
+        free(reader->filename);
+        free(reader);
+    }
+}
+
+/* reads more of irq2in into text, dropping what is before both the next line and the next number. text grows only
+   when the numbers fall a whole buffer behind the lines (or ahead of them, in a number too long for a line) */
+void read_more_irq2in(irq2_reader* reader) {
+    long long first = reader->scanning && reader->token < reader->offset ? reader->token : reader->offset;
+    size_t drop = (size_t)(first - reader->start), read;
+
+    memmove(reader->text, &reader->text[drop], reader->size - drop);
+    reader->size -= drop;
+    reader->start = first;
+    if (reader->size == reader->capacity) {
+        reader->capacity *= 2;
+        reader->text = realloc(reader->text, reader->capacity);
+        if (reader->text == NULL) {
+            printf("An Error Has Occurred With File %s\n", reader->filename);
+            exit(1);
+        }
+    }
+    read = fread(&reader->text[reader->size], 1, reader->capacity - reader->size, reader->file);
+    reader->size += read;
+    reader->end = read == 0;
+}
+
+/* reads on until text holds the whole number at token: its whitespace, sign and digits and what follows them */
+void read_irq2_token(irq2_reader* reader) {
+    long long position = reader->token;
+    bool sign = false; /* true once past the whitespace */
+    char c;
+
+    for (;;) {
+        if (position - reader->start == (long long)reader->size) {
+            if (reader->end) {
+                return;
+            }
+            read_more_irq2in(reader);
+            continue;
+        }
+        c = reader->text[position - reader->start];
+        if (!sign && isspace((unsigned char)c)) {
+            position++;
+        }
+        else if (!sign && (c == '-' || c == '+')) {
+            sign = true;
+            position++;
+        }
+        else if (isdigit((unsigned char)c)) {
+            sign = true;
+            position++;
+        }
+        else {
+            return;
+        }
     }
-    fclose(diskin_file);
-    return;
 }
 
-/* create irq2in_array of clock cycles in which irq2status is set to 1
- (for a single clock cycle), as set by the input file
- The array is allocated by this function based in the file length and should be freed by the caller*/
-int* initialize_irq2in_array(char* irq2in_filename) {
-    int i, rows_counter = 0;
-    FILE* irq2in_file = NULL;
+/* reads the number of the next non-empty line of irq2in into *cycle. returns false at the end of the file.
+   the numbers are read from token on the way fscanf("%d\n") reads them, apart from the lines: a line that doesn't
+   start with a number stops the reading there, and it and the lines after it are 0. the first malformed line is
+   reported on stderr */
+bool read_irq2_event(irq2_reader* reader, int* cycle) {
     char line_buffer[MAX_LINE_SIZE + 1];
+    size_t offset, end, line_end;
+    int value;
+    bool newline, counted;
+
+    for (;;) {
+        offset = (size_t)(reader->offset - reader->start);
+        if (reader->size - offset <= MAX_LINE_SIZE && !reader->end) {
+            read_more_irq2in(reader);
+            continue;
+        }
+        if (offset == reader->size) {
+            return false;
+        }
+        /* a line of up to 9 digits, where the next number is read from, is read right where it is */
+        if (reader->scanning && reader->token == reader->offset) {
+            for (end = offset, value = 0; end < reader->size && end - offset < 9 && isdigit((unsigned char)reader->text[end]); end++) {
+                value = 10 * value + (reader->text[end] - '0');
+            }
+            if (end > offset && end < reader->size && reader->text[end] == '\n') {
+                reader->offset = reader->token = reader->start + end + 1;
+                reader->line++;
+                *cycle = value;
+                return true;
+            }
+        }
+        line_end = read_input_line(reader->text, reader->size, offset, line_buffer);
+        newline = reader->text[line_end - 1] == '\n';
+        reader->offset = reader->start + line_end;
+        counted = empty_line_check(line_buffer) != 1;
+        if (counted) {
+            value = 0;
+            if (reader->scanning) {
+                read_irq2_token(reader);
+                end = (size_t)(reader->token - reader->start);
+                value = scan_decimal_token(reader->text, reader->size, &end, &reader->scanning);
+                reader->token = reader->start + end;
+            }
+            if (!reader->reported && !decimal_line_check(line_buffer)) {
+                fprintf(stderr, "Malformed Line %d In File %s\n", reader->line, reader->filename);
+                reader->reported = true;
+            }
+        }
+        while (reader->token < reader->offset && isspace((unsigned char)reader->text[reader->token - reader->start])) {
+            reader->token++; /* fscanf skips it on the next number */
+        }
+        if (newline) {
+            reader->line++;
+        }
+        if (counted) {
+            *cycle = value;
+            return true;
+        }
+    }
+}
+
+/* parses an irq2 generator, given instead of irq2in:
+   periodic:period[,first] raises irq2 every period cycles from first (period by default),
+   bursty:period,length[,spacing] raises it length times spacing cycles apart (1 by default) every period cycles,
+   random:mean[,seed] raises it after 1 to 2 * mean - 1 cycles each time, from a xorshift64* generator started from
+   seed (1 by default). returns false if spec isn't valid */
+bool parse_irq2_generator(char* spec, irq2_generator* generator) {
+    char* kinds[] = { "periodic:", "bursty:", "random:" };
+    long long values[3];
+    int count = 0, i;
+    char* text, * end;
+
+    for (generator->kind = 0; generator->kind < 3; generator->kind++) {
+        if (strncmp(spec, kinds[generator->kind], strlen(kinds[generator->kind])) == 0) {
+            break;
+        }
+    }
+    if (generator->kind == 3) {
+        return false;
+    }
+    for (text = spec + strlen(kinds[generator->kind]); count < 3; text = end + 1) {
+        values[count++] = strtoll(text, &end, 10);
+        if (end == text || *end != ',') {
+            break;
+        }
+    }
+    if (end == text || *end != '\0' || values[0] < 1) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        if (values[i] < 0 || values[i] > INT32_MAX) {
+            return false;
+        }
+    }
+    switch (generator->kind) {
+    case IRQ2_PERIODIC:
+        generator->period = (int)values[0];
+        generator->first = count > 1 ? (int)values[1] : generator->period;
+        return count <= 2;
+    case IRQ2_BURSTY:
+        generator->period = (int)values[0];
+        generator->first = generator->period;
+        generator->length = count > 1 ? (int)values[1] : 0;
+        generator->spacing = count > 2 ? (int)values[2] : 1;
+        return count >= 2 && generator->length >= 1 && generator->spacing >= 1 &&
+            (long long)(generator->length - 1) * generator->spacing < generator->period; /* a burst ends before the next one */
+    default:
+        generator->mean = (int)values[0];
+        generator->seed = count > 1 ? (uint64_t)values[1] : 1;
+        return count <= 2 && generator->mean <= INT32_MAX / 2;
+    }
+}
+
+/* returns true iff irq2in is a generator (valid or not) rather than the name of a file */
+bool irq2_generator_check(char* irq2in) {
+    return strncmp(irq2in, "periodic:", 9) == 0 || strncmp(irq2in, "bursty:", 7) == 0 || strncmp(irq2in, "random:", 7) == 0;
+}
+
+/* starts the generator over from its first event */
+void rewind_irq2_generator(irq2_generator* generator) {
+    generator->cycle = generator->kind == IRQ2_RANDOM ? 0 : generator->first;
+    generator->index = 0;
+    generator->state = generator->seed * 0x9e3779b97f4a7c15ULL + 1; /* xorshift can't start from 0 */
+}
 
-    irq2in_file = fopen(irq2in_filename, "r");
-    open_file_check(irq2in_filename, irq2in_file);
+/* makes the next event of the generator. returns false once the clock can't get to it */
+bool generate_irq2_event(irq2_generator* generator, int* cycle) {
+    long long next;
+    switch (generator->kind) {
+    case IRQ2_PERIODIC:
+        next = generator->cycle;
+        generator->cycle += generator->period;
+        break;
+    case IRQ2_BURSTY:
+        next = generator->cycle + (long long)generator->index * generator->spacing;
+        if (++generator->index == generator->length) {
+            generator->index = 0;
+            generator->cycle += generator->period;
+        }
+        break;
+    default:
+        generator->cycle += 1 + fuzz_random(&generator->state) % (2 * generator->mean - 1);
+        next = generator->cycle;
+        break;
+    }
+    if (next > INT32_MAX) {
+        generator->cycle = next; /* and every event after it too */
+        return false;
+    }
+    *cycle = (int)next;
+    return true;
+}
+
+/* reads (or generates) the next IRQ2_READ_AHEAD irq2 events, once the ones before them were all raised */
+void read_irq2_events(irq2_events* irq2) {
+    int count = 0;
+    if (irq2->source == IRQ2_ARRAY) {
+        return;
+    }
+    while (count < IRQ2_READ_AHEAD && (irq2->source == IRQ2_FILE ? read_irq2_event(irq2->reader, &irq2->cycles[count]) :
+        generate_irq2_event(&irq2->generator, &irq2->cycles[count]))) {
+        count++;
+    }
+    irq2->count = count;
+    irq2->next = 0;
+}
 
-    /* count the number of non-empty lines in the file */
-    while (fgets(line_buffer, MAX_LINE_SIZE + 1, irq2in_file)) {
-        if (empty_line_check(line_buffer) != 1) { /* if line is not empty */
-            rows_counter++;
+/* starts the irq2 events of irq2in, which is a file or a generator (see parse_irq2_generator), and reads the first
+   of them. only IRQ2_READ_AHEAD events at a time are held in memory, however many there are */
+void open_irq2_events(irq2_events* irq2, char* irq2in) {
+    irq2->cycles = malloc(IRQ2_READ_AHEAD * sizeof(int));
+    if (irq2->cycles == NULL) {
+        printf("An Error Has Occurred With File %s\n", irq2in);
+        exit(1);
+    }
+    irq2->reader = NULL;
+    if (irq2_generator_check(irq2in)) {
+        if (!parse_irq2_generator(irq2in, &irq2->generator)) {
+            printf("An Error Has Occurred With The irq2 Generator %s\n", irq2in);
+            exit(1);
         }
+        irq2->source = IRQ2_GENERATOR;
+        rewind_irq2_generator(&irq2->generator);
+    }
+    else {
+        irq2->source = IRQ2_FILE;
+        irq2->reader = open_irq2_reader(irq2in);
     }
+    irq2->raised = 0;
+    read_irq2_events(irq2);
+}
 
-    /* reset file pointer */
-    rewind(irq2in_file);
-    int* irq2cycles_array = calloc(rows_counter, sizeof(int));
+/* starts the irq2 events over and skips the first raised of them, as if they were raised already */
+void seek_irq2_events(irq2_events* irq2, int raised) {
+    int skipped;
+    if (irq2->source == IRQ2_FILE) {
+        rewind_irq2_reader(irq2->reader);
+    }
+    else if (irq2->source == IRQ2_GENERATOR) {
+        rewind_irq2_generator(&irq2->generator);
+    }
+    irq2->next = irq2->source == IRQ2_ARRAY ? 0 : irq2->count;
+    read_irq2_events(irq2);
+    for (irq2->raised = 0; irq2->raised < raised && irq2->next < irq2->count; irq2->raised += skipped) {
+        skipped = raised - irq2->raised < irq2->count - irq2->next ? raised - irq2->raised : irq2->count - irq2->next;
+        irq2->next += skipped;
+        if (irq2->next == irq2->count) {
+            read_irq2_events(irq2);
+        }
+    }
+}
 
-    /* fill the array */
-    for (i = 0; i < rows_counter; i++) {
-        fscanf(irq2in_file, "%d\n", &irq2cycles_array[i]);
+/* frees the irq2 events read from a file or a generator. an array is kept by the caller */
+void free_irq2_events(irq2_events* irq2) {
+    if (irq2->source != IRQ2_ARRAY) {
+        free(irq2->cycles);
+        close_irq2_reader(irq2->reader);
     }
-    fclose(irq2in_file);
-    return irq2cycles_array;
 }
 
 /* initialize zero values to both registers arrays, registers and io_registers */
@@ -205,27 +1050,119 @@ void initialize_registers(int *registers, int *io_registers) {
     }
 }
 
+/**************************************************************/
+/********************** formatting Output *********************/
+/**************************************************************/
+
+/* stores the upper case hex digits of value at text, at least digits of them like "%0*X" does, and returns the end of
+   them. text must have room for 8 characters whatever the number of digits.
+   the 8 nibbles are spread to a byte each, the most significant first in memory, and turned to ASCII together */
+char* put_hex(char* text, uint32_t value, int digits) {
+    uint64_t x, letters;
+    while (digits < 8 && value >> 4 * digits != 0) {
+        digits++;
+    }
+    x = (uint32_t)(value << (32 - 4 * digits));
+    x = x >> 16 | (x & 0xffff) << 32;
+    x = (x & 0x0000ff000000ff00) >> 8 | (x & 0x000000ff000000ff) << 16;
+    x = (x & 0x00f000f000f000f0) >> 4 | (x & 0x000f000f000f000f) << 8;
+    letters = (x + 0x0606060606060606) >> 4 & 0x0101010101010101; /* 1 in the bytes of nibbles above 9 */
+    x += 0x3030303030303030 + letters * ('A' - '0' - 10);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(text, &x, 8);
+    return text + digits;
+}
+
+/* stores value in decimal like "%d" at text and returns the end of it */
+char* put_decimal(char* text, int value) {
+    char digits[12];
+    int length = 0;
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    if (value < 0) {
+        *text++ = '-';
+    }
+    do {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    while (length > 0) {
+        *text++ = digits[--length];
+    }
+    return text;
+}
+
+/* stores a string at text and returns the end of it */
+char* put_text(char* text, const char* string) {
+    size_t length = strlen(string);
+    memcpy(text, string, length);
+    return text + length;
+}
+
+/* writes the buffer of an output file to the file */
+void flush_output_file(output_file* out) {
+    size_t written = 0;
+#ifdef _WIN32
+    written = fwrite(out->buffer, 1, out->used, out->file);
+#else
+    ssize_t result;
+    while (written < out->used && (result = write(fileno(out->file), &out->buffer[written], out->used - written)) > 0) {
+        written += result;
+    }
+#endif
+    if (written != out->used) {
+        printf("An Error Has Occurred With The Output\n");
+        exit(1);
+    }
+    out->used = 0;
+}
+
+/* opens an output file with an empty buffer */
+void open_output_file(output_file* out, char* filename, bool binary) {
+    out->file = fopen(filename, binary ? "wb" : "w");
+    open_file_check(filename, out->file);
+    out->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (out->buffer == NULL) {
+        printf("An Error Has Occurred With The Output\n");
+        exit(1);
+    }
+    out->used = 0;
+}
+
+/* returns where the next line of an output file is formatted, with room for OUTPUT_LINE_MAX characters.
+   output_line_end then takes the line up to end into the buffer */
+char* output_line(output_file* out) {
+    if (out->used > OUTPUT_BUFFER_SIZE - OUTPUT_LINE_MAX) {
+        flush_output_file(out);
+    }
+    return &out->buffer[out->used];
+}
+void output_line_end(output_file* out, char* end) {
+    out->used = end - out->buffer;
+}
+
+/* writes what is left in the buffer and closes the output file */
+void close_output_file(output_file* out) {
+    flush_output_file(out);
+    fclose(out->file);
+    free(out->buffer);
+}
+
 /**************************************************************/
 /*********************** create Output Files ******************/
 /**************************************************************/
 
 /* writes to the memout output file */
-void create_memout(char** main_memory, char* memout_filename) {
+void create_memout(uint32_t* main_memory, int memory_end, char* memout_filename) {
     int i, last_row_index;
-    FILE* memout_file = NULL;
-    memout_file = fopen(memout_filename, "w");
-    open_file_check(memout_filename, memout_file);
-
-    /* create a string of "00...0" */
-    char zeros_string[MEMWORD_WIDTH_HEX + 1];
-    for (i = 0; i < MEMWORD_WIDTH_HEX; i++) {
-        zeros_string[i] = '0';
-    }
-    zeros_string[i] = '\0';
+    char* line;
+    output_file memout_file;
+    open_output_file(&memout_file, memout_filename, false);
 
-    /* find the last address of non-zero data start searching from the last row */
-    for (i = MAIN_MEMORY_DEPTH - 1; i >= 0; i--) {
-        if (strcmp(main_memory[i], &zeros_string) != 0) {
+    /* find the last address of non-zero data start searching from the high-water mark of main memory */
+    for (i = memory_end - 1; i >= 0; i--) {
+        if (main_memory[i] != 0) {
             break;
         }
     }
@@ -233,71 +1170,152 @@ void create_memout(char** main_memory, char* memout_filename) {
     
     /* write the data to memout file, stop writing in the last non-zero row */
     for (i = 0; i <= last_row_index; i++) {
-        fprintf(memout_file, "%s\n", main_memory[i]);
+        line = put_hex(output_line(&memout_file), main_memory[i], MEMWORD_WIDTH_HEX);
+        *line++ = '\n';
+        output_line_end(&memout_file, line);
     }
-    fclose(memout_file);
+    close_output_file(&memout_file);
 }
 
 /* writes to the regout output file from the registers array (places 3-15, excluding 0-2) */
 void create_regout(int *registers, char* regout_filename) {
     int i;
-    FILE* regout_file = NULL;
-    regout_file = fopen(regout_filename, "w");
-    open_file_check(regout_filename, regout_file);
+    char* line;
+    output_file regout_file;
+    open_output_file(&regout_file, regout_filename, false);
 
     for (i = 2; i <= 15; i++) {
-        fprintf(regout_file, "%08X\n", registers[i]);
+        line = put_hex(output_line(&regout_file), registers[i], 8);
+        *line++ = '\n';
+        output_line_end(&regout_file, line);
     }
-    fclose(regout_file);
+    close_output_file(&regout_file);
 }
 
-/* writes data from the disk to the diskout output file */
-void create_diskout(char** disk, char* diskout_filename) {
-    int i, max_row;
-    FILE* diskout_file = NULL;
-    diskout_file = fopen(diskout_filename, "w");
-    open_file_check(diskout_filename, diskout_file);
+/* writes data from the disk to the diskout output file.
+   sectors that were never used are parsed from the disk image only now, and sectors past the end of the image that were never
+   written are known to be zero and skipped. zero words are held back until a non-zero word follows, so that the file ends
+   with the last non-zero word */
+void create_diskout(disk_image* disk, char* diskout_filename) {
+    int sector, i, pending_zeros = 0;
+    uint32_t* words;
+    char* line;
+    output_file diskout_file;
+    open_output_file(&diskout_file, diskout_filename, false);
 
-    /* find the last address of non-zero data start serching from the last row */
-    for (i = DISK_SECTORS * LINES_PER_SECTOR - 1; i >= 0; i--) {
-        if (strcmp(disk[i], "00000") != 0) {
-            break;
+    for (sector = 0; sector < DISK_SECTORS; sector++) {
+        if (!disk->resident[sector] && disk->indexed_sectors == sector && disk->sector_offsets[sector] >= disk->image_size) {
+            pending_zeros += LINES_PER_SECTOR; /* all zero */
+            continue;
+        }
+        words = load_disk_sector(disk, sector);
+        for (i = 0; i < LINES_PER_SECTOR; i++) {
+            if (words[i] == 0) {
+                pending_zeros++;
+                continue;
+            }
+            for (; pending_zeros > 0; pending_zeros--) {
+                output_line_end(&diskout_file, put_text(output_line(&diskout_file), "00000\n"));
+            }
+            line = put_hex(output_line(&diskout_file), words[i], MEMWORD_WIDTH_HEX);
+            *line++ = '\n';
+            output_line_end(&diskout_file, line);
         }
     }
-    max_row = i;
-
-    /* write the data to diskout file */
-    for (i = 0; i <= max_row; i++) {
-        fprintf(diskout_file, "%s\n", disk[i]);
-    }
-    fclose(diskout_file);
+    close_output_file(&diskout_file);
 }
 
 /* writes to the monitor output file: monitor.txt */
-void create_monitor_txt(char** monitor, char* monitortxt_filename) {
+void create_monitor_txt(uint8_t* monitor, int monitor_end, char* monitortxt_filename) {
     int i, last_row;
-    unsigned char pixel;
-    FILE* monitortxt_file = NULL;
-    monitortxt_file = fopen(monitortxt_filename, "w");
-    open_file_check(monitortxt_filename, monitortxt_file);
-
-    /* getting the last address of non-zero data */
-    for (i = MONITOR_PX_DIM * MONITOR_PX_DIM - 1; i >= 0; i--) {
-        if (strcmp(monitor[i], "00") != 0) {
+    char* line;
+    output_file monitortxt_file;
+    open_output_file(&monitortxt_file, monitortxt_filename, false);
+
+    /* getting the last address of non-zero data, below the high-water mark of the monitor */
+    for (i = monitor_end - 1; i >= 0; i--) {
+        if (monitor[i] != 0) {
             break;
         }
     }
     last_row = i;
 
     for (i = 0; i <= last_row; i++) {
-        fprintf(monitortxt_file, "%s\n", monitor[i]);
+        line = put_hex(output_line(&monitortxt_file), monitor[i], MONITOR_WIDTH_HEX);
+        *line++ = '\n';
+        output_line_end(&monitortxt_file, line);
     }
     
-    fclose(monitortxt_file);
+    close_output_file(&monitortxt_file);
+}
+
+/* writes the whole monitor framebuffer as a binary image: raw 8-bit luma (monitor.yuv) or,
+   if the file name ends with .pgm, a binary PGM image that common image viewers can open */
+void create_monitor_image(uint8_t* monitor, char* monitorimg_filename) {
+    size_t name_length = strlen(monitorimg_filename);
+    FILE* monitorimg_file = NULL;
+    monitorimg_file = fopen(monitorimg_filename, "wb");
+    open_file_check(monitorimg_filename, monitorimg_file);
+
+    if (name_length >= 4 && strcmp(&monitorimg_filename[name_length - 4], ".pgm") == 0) {
+        fprintf(monitorimg_file, "P5\n%d %d\n255\n", MONITOR_PX_DIM, MONITOR_PX_DIM);
+    }
+    fwrite(monitor, 1, MONITOR_PIXELS, monitorimg_file);
+    fclose(monitorimg_file);
+}
+
+/* writes the 64 word pages of main memory, the sectors of the disk and the 64 pixel pages of the monitor that the
+   dirty map marks, a line each: memory, sector or monitor, the number of the first word (or the sector) and its words */
+void create_delta(dirty_map* dirty, uint32_t* main_memory, disk_image* disk, uint8_t* monitor, char* delta_filename) {
+    int page, i;
+    uint32_t* words;
+    char* line;
+    output_file delta_file;
+    open_output_file(&delta_file, delta_filename, false);
+
+    for (page = 0; page < MAIN_MEMORY_DEPTH / 64; page++) {
+        if (dirty->memory[page] != 0) {
+            line = put_hex(put_text(output_line(&delta_file), "memory "), page * 64, 3);
+            for (i = page * 64; i < page * 64 + 64; i++) {
+                *line++ = ' ';
+                line = put_hex(line, main_memory[i], MEMWORD_WIDTH_HEX);
+            }
+            *line++ = '\n';
+            output_line_end(&delta_file, line);
+        }
+    }
+    for (page = 0; page < DISK_SECTORS; page++) {
+        if (dirty->sectors[page >> 6] & (uint64_t)1 << (page & 63)) {
+            words = load_disk_sector(disk, page);
+            line = put_hex(put_text(output_line(&delta_file), "sector "), page, 2);
+            for (i = 0; i < LINES_PER_SECTOR; i++) { /* 7 + 2 + 6 * 128 + 1 characters, more than OUTPUT_LINE_MAX */
+                if (i == LINES_PER_SECTOR / 2) {
+                    output_line_end(&delta_file, line);
+                    line = output_line(&delta_file);
+                }
+                *line++ = ' ';
+                line = put_hex(line, words[i], MEMWORD_WIDTH_HEX);
+            }
+            *line++ = '\n';
+            output_line_end(&delta_file, line);
+        }
+    }
+    for (page = 0; page < MONITOR_PIXELS / 64; page++) {
+        if (dirty->monitor[page] != 0) {
+            line = put_hex(put_text(output_line(&delta_file), "monitor "), page * 64, 4);
+            for (i = page * 64; i < page * 64 + 64; i++) {
+                *line++ = ' ';
+                line = put_hex(line, monitor[i], MONITOR_WIDTH_HEX);
+            }
+            *line++ = '\n';
+            output_line_end(&delta_file, line);
+        }
+    }
+    close_output_file(&delta_file);
 }
 
 /* writes to the cycles output file the cycle count at the end of the run */
-void create_cycles(int* clock_cycle_counter, char* cycles_filename) {
+void create_cycles(int clock_cycle_counter, char* cycles_filename) {
     FILE* cycles_file = NULL;
     cycles_file = fopen(cycles_filename, "w");
     open_file_check(cycles_filename, cycles_file);
@@ -306,24 +1324,6 @@ void create_cycles(int* clock_cycle_counter, char* cycles_filename) {
     fclose(cycles_file);
 }
 
-/* close the files: trace, hwregtrace, leds, display7seg
-   free the strings in the memory arrays: main_memory, disk, monitor
-   and finally free irq2cycles_array. */
-void close_files_and_free_memory(FILE* trace_file, FILE* hwregtrace_file, FILE* leds_file, FILE* display7seg_file, char** main_memory, char** disk, char** monitor, int* irq2cycles_array) {
-    /* close files */
-    fclose(trace_file);
-    fclose(hwregtrace_file);
-    fclose(leds_file);
-    fclose(display7seg_file);
-
-    /* free the memory of all the arrays we define */
-    int i;
-    for (i = 0; i < MAIN_MEMORY_DEPTH; i++) { free(main_memory[i]); }
-    for (i = 0; i < DISK_SECTORS * LINES_PER_SECTOR; i++) { free(disk[i]); }
-    for (i = 0; i < MONITOR_PX_DIM * MONITOR_PX_DIM; i++) { free(monitor[i]); }
-    free(irq2cycles_array);
-}
-
 /**************************************************************/
 /**************** Strings and other Functions *****************/
 /**************************************************************/
@@ -350,124 +1350,388 @@ void reg_io_num_to_name(int reg_io_num, char* reg_io_name) {
     case 15: strcpy(reg_io_name, "disksector"); break;
     case 16: strcpy(reg_io_name, "diskbuffer"); break;
     case 17: strcpy(reg_io_name, "diskstatus"); break;
-    case 18: strcpy(reg_io_name, "reserved"); break;
-    case 19: strcpy(reg_io_name, "reserved"); break;
+    case 18: strcpy(reg_io_name, "diskqueue"); break;
+    case 19: strcpy(reg_io_name, "diskdone"); break;
     case 20: strcpy(reg_io_name, "monitoraddr"); break;
     case 21: strcpy(reg_io_name, "monitordata"); break;
     case 22: strcpy(reg_io_name, "monitorcmd"); break;
     }
 }
 
-/* calculates a (mod b) for b > 0 */
-int mod(int a, int b) {
-    int result;
-    result = a % b;
-    if (a < 0 && b > 0) {
-        result += b;
-    }
-    return result;
+bool imm_instruction(int rd, int rs, int rt) {
+    return (rs == 1 || rt == 1 || rd == 1);
 }
 
-/* converts a string of a number in hexadecimal to an integer. if the input number is negative it needs
-to be sign extended properly for the output integer to be negative */
-int hex_to_int(char* num_hex) {
-    int num;
-    sscanf(num_hex, "%X", &num);
-    return num;
-}
+/* decodes the word at the given address of main memory into its opcode, registers and immediate value
+   and stores the result in decoded_memory[address]. the immediate value is taken from the next word, and is only
+   meaningful if the instruction uses $imm. this is the only place where instruction words are parsed */
+void decode_instruction(uint32_t* main_memory, decoded_instruction* decoded_memory, int address) {
+    decoded_instruction* decoded = &decoded_memory[address];
+    int word = main_memory[address];
 
-/* first it convert hexadecimal string and turns it into an integer number
-   then extracts from the number all the values of the registers rd, rt, rs and opcode */
-void get_registers_values_from_hex_string_instruction(char* hex_string, int* p_rt, int* p_rs, int* p_rd, int* p_opcode) {
-    
-   int num;
-   char* rt_str[2]; 
-   strncpy(rt_str, &hex_string[4], 1);
-   rt_str[1] = '\0';
-   sscanf(rt_str, "%X", &num);
-   *p_rt = num;
-
-   char* rs_str[2];
-   strncpy(rs_str, &hex_string[3], 1);
-   rs_str[1] = '\0';
-   sscanf(rs_str, "%X", &num);
-   *p_rs = num;
-    
-   char* rd_str[2];
-   strncpy(rs_str, &hex_string[2], 1);
-   rd_str[1] = '\0';
-   sscanf(rs_str, "%X", &num);
-   *p_rd = num;
-
-   char* opcode_str[2];
-   strncpy(opcode_str, &hex_string[0], 2);
-   opcode_str[1] = '\0';
-   sscanf(opcode_str, "%X", &num);
-   *p_opcode = num;
+    decoded->opcode = (word >> 12) & 0xff;
+    decoded->rd = (word >> 8) & 0xf;
+    decoded->rs = (word >> 4) & 0xf;
+    decoded->rt = word & 0xf;
+    decoded->is_immediate = imm_instruction(decoded->rd, decoded->rs, decoded->rt);
+    decoded->imm = 0;
+    if (decoded->is_immediate) {
+        /* sign extend immediate value, flipping the sign bit so that it never has to be shifted */
+        decoded->imm = (int)((main_memory[(address + 1) % MAIN_MEMORY_DEPTH] & MEMWORD_MASK) ^ 0x80000) - 0x80000;
+    }
 
-    return;
+    /* choose the specialised handler for the threaded engine. add may write $imm, but the other
+       arithmetic instructions leave both $zero and $imm unchanged */
+    decoded->handler = HANDLERS_PER_OPCODE * (decoded->opcode <= MAX_OPCODE_NUM ? decoded->opcode : MAX_OPCODE_NUM + 1);
+    decoded->handler += decoded->is_immediate ? HANDLER_IMM : HANDLER_REG;
+    if ((decoded->opcode == 0 && decoded->rd == ZERO_REG) ||
+        (decoded->opcode >= 1 && decoded->opcode <= 8 && (decoded->rd == ZERO_REG || decoded->rd == IMM_REG))) {
+        decoded->handler += HANDLER_REG_NOP;
+    }
 }
 
-/* convert 5 digit hexadecimal string (representing a word in memory) into an integer number and return the number */
-int get_imm_from_memory_word(char* instruction) {
-    int num;
-    sscanf(instruction, "%X", &num);
-    num = (num << 12) >> 12; /* sign extend immediate value */
-    return num;
+/* decodes every word of main memory into decoded_memory, which should point to a MAIN_MEMORY_DEPTH entries long array */
+void decode_main_memory(uint32_t* main_memory, decoded_instruction* decoded_memory) {
+    int i;
+    for (i = 0; i < MAIN_MEMORY_DEPTH; i++) {
+        decode_instruction(main_memory, decoded_memory, i);
+    }
 }
 
-/* converts an integer (may be negative) into a hexadecimal string of 5 digits, representing a word in main or disk memory.
-   If it is larger than 20 bits only the lower 20 bits are used.
-   the result is stored in the num_hex buffer */
-void int_to_mem_word(int num, char* num_hex) {
-    sprintf(num_hex, "%05X", num & 0xfffff);
+/* re-decodes the words affected by writing length words to main memory starting at address.
+   the word before the range is included since its immediate value may be the first written word */
+void redecode_main_memory(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, int address, int length) {
+    int i, word;
+    for (i = -1; i < length; i++) {
+        decode_instruction(main_memory, decoded_memory, mod(address + i, MAIN_MEMORY_DEPTH));
+    }
+    for (i = 0; i < length; i++) {
+        word = mod(address + i, MAIN_MEMORY_DEPTH);
+        DIRTY_MARK(dirty->memory, word);
+        if (word >= dirty->memory_end) {
+            dirty->memory_end = word + 1;
+        }
+    }
 }
 
-/* converts an integer (may be negative) into a hexadecimal string of 2 digits, representing pixel brightness in the monitor.
-If it is larger than 8 bits only the lower 8 bits are used.
-the result is stored in the num_hex buffer */
-void int_to_monitor_word(int num, char* num_hex) {
-    sprintf(num_hex, "%02X", num & 0xff);
+/* clears the bitmaps of the dirty map, keeping its high-water marks */
+void clear_dirty_map(dirty_map* dirty) {
+    memset(dirty->memory, 0, sizeof(dirty->memory));
+    memset(dirty->sectors, 0, sizeof(dirty->sectors));
+    memset(dirty->monitor, 0, sizeof(dirty->monitor));
 }
 
 /**************************************************************/
-/**************** Functions for each iteration ****************/
+/*************************** output ***************************/
 /**************************************************************/
 
-/* writes a single line to the output trace file */
-void update_trace(int PC, char* instruction, int* registers, FILE* trace_file) {
+/* the lines of trace, hwregtrace, leds and display7seg are pushed by the simulation as unformatted records into the
+   ring of the output writer. with -output async (the default where threads are available) a writer thread formats
+   and writes them while the simulation goes on. the simulation waits only when the ring is full.
+   with -output sync every record is written as soon as it is pushed. either way the ring keeps the last
+   OUTPUT_RING_SIZE records, which is how idle loops repeat the lines of an iteration */
+
+/* stores a 16 or 32 bit number in little endian order */
+void store_uint16(uint8_t* bytes, uint32_t value) {
+    bytes[0] = value & 0xff;
+    bytes[1] = (value >> 8) & 0xff;
+}
+void store_uint32(uint8_t* bytes, uint32_t value) {
+    store_uint16(bytes, value & 0xffff);
+    store_uint16(&bytes[2], value >> 16);
+}
+
+/* writes a single line (a record in binary mode) to the trace file */
+void write_trace_line(trace_writer* trace_file, int PC, uint32_t instruction, int* registers) {
     
     int i;
+    if (trace_file->binary) {
+        uint8_t record[TRACE_RECORD_MAX_SIZE];
+        int changed = 0, size = 6;
+        for (i = 0; i < NUM_OF_REGISTERS; i++) {
+            if (registers[i] != trace_file->registers[i]) {
+                changed |= 1 << i;
+                store_uint32(&record[size], registers[i]);
+                size += 4;
+                trace_file->registers[i] = registers[i];
+            }
+        }
+        store_uint32(record, (instruction & MEMWORD_MASK) | ((uint32_t)PC << 20));
+        store_uint16(&record[4], changed);
+        memcpy(output_line(&trace_file->file), record, size);
+        trace_file->file.used += size;
+        return;
+    }
     
     /* 3 digits for PC */
-    char pc_str[4];
-    sprintf(pc_str, "%03X", PC);
-    fprintf(trace_file, "%s ", pc_str);
+    char* line = put_hex(output_line(&trace_file->file), PC, 3);
+    *line++ = ' ';
     
-    /* 5 digits for clock cycle */
-    fprintf(trace_file, "%s ", instruction);
+    /* 5 digits for the instruction */
+    line = put_hex(line, instruction, MEMWORD_WIDTH_HEX);
 
     /* 8 digits for eche register */
-    for (i = 0; i < 15; i++) {
-        fprintf(trace_file, "%08X ", registers[i]);
+    for (i = 0; i < NUM_OF_REGISTERS; i++) {
+        *line++ = ' ';
+        line = put_hex(line, registers[i], 8);
     }
-    fprintf(trace_file, "%08X\n", registers[i]); /* for i = 15 */
+    *line++ = '\n';
+    output_line_end(&trace_file->file, line);
 }
 
-/* writes a single line to the output hwregtrace file */
-void update_hwregtrace(int* io_registers, int clock_cycle_counter, char* command, int io_reg_num, FILE* hwregtrace_file) {
+/* writes a single line (a record in binary mode) to the hwregtrace file */
+void write_hwregtrace_line(trace_writer* hwregtrace_file, int clock_cycle_counter, bool write, int io_reg_num, int value) {
     
-    char io_reg_name[32];
+    char io_reg_name[32], * line;
+    if (hwregtrace_file->binary) {
+        uint8_t record[HWREGTRACE_RECORD_SIZE];
+        store_uint32(record, clock_cycle_counter);
+        record[4] = io_reg_num * 2 + write;
+        store_uint32(&record[5], value);
+        memcpy(output_line(&hwregtrace_file->file), record, HWREGTRACE_RECORD_SIZE);
+        hwregtrace_file->file.used += HWREGTRACE_RECORD_SIZE;
+        return;
+    }
     reg_io_num_to_name(io_reg_num, io_reg_name);
-    fprintf(hwregtrace_file, "%d %s %s %08X\n", clock_cycle_counter, command, io_reg_name, io_registers[io_reg_num]);
+    line = put_decimal(output_line(&hwregtrace_file->file), clock_cycle_counter);
+    line = put_text(line, write ? " WRITE " : " READ ");
+    line = put_text(line, io_reg_name);
+    *line++ = ' ';
+    line = put_hex(line, value, 8);
+    *line++ = '\n';
+    output_line_end(&hwregtrace_file->file, line);
 }
 
-bool imm_instruction(int rd, int rs, int rt) {
-    return (rs == 1 || rt == 1 || rd == 1);
+/* writes a line to the leds or display7seg file */
+void write_io_line(output_file* out, int clock_cycle_counter, int value) {
+    char* line = put_decimal(output_line(out), clock_cycle_counter);
+    *line++ = ' ';
+    line = put_hex(line, value, 8);
+    *line++ = '\n';
+    output_line_end(out, line);
+}
+
+/* writes a record to its output file */
+void write_output_record(output_writer* output, output_record* record) {
+    switch (record->type) {
+    case OUTPUT_TRACE:
+        write_trace_line(&output->trace_file, record->data.trace.PC, record->data.trace.instruction, record->data.trace.registers);
+        break;
+    case OUTPUT_HWREGTRACE_READ:
+    case OUTPUT_HWREGTRACE_WRITE:
+        write_hwregtrace_line(&output->hwregtrace_file, record->data.io.clock_cycle_counter, record->type == OUTPUT_HWREGTRACE_WRITE,
+            record->data.io.io_reg_num, record->data.io.value);
+        break;
+    case OUTPUT_LEDS:
+        write_io_line(&output->leds_file, record->data.io.clock_cycle_counter, record->data.io.value);
+        break;
+    case OUTPUT_DISPLAY7SEG:
+        write_io_line(&output->display7seg_file, record->data.io.clock_cycle_counter, record->data.io.value);
+        break;
+    }
+}
+
+#ifdef ASYNC_OUTPUT
+/* the writer thread. writes the records pushed to the ring until the simulation is done and the ring is empty */
+void* output_thread(void* arg) {
+    output_writer* output = arg;
+    unsigned written = 0, pushed;
+    bool done;
+    struct timespec pause = { 0, OUTPUT_THREAD_PAUSE_NS };
+
+    for (;;) {
+        done = atomic_load_explicit(&output->done, memory_order_acquire);
+        pushed = atomic_load_explicit(&output->pushed_index, memory_order_acquire);
+        if (written == pushed) {
+            if (done) {
+                return NULL;
+            }
+            nanosleep(&pause, NULL); /* nothing to write, let the simulation fill the ring */
+            continue;
+        }
+        while (written != pushed) {
+            write_output_record(output, &output->ring[written & (OUTPUT_RING_SIZE - 1)]);
+            written++;
+            if ((written & (OUTPUT_RELEASE_BATCH - 1)) == 0) {
+                atomic_store_explicit(&output->written_index, written, memory_order_release);
+            }
+        }
+        atomic_store_explicit(&output->written_index, written, memory_order_release);
+    }
+}
+#endif
+
+/* returns the ring entry for the next record, waiting for the writer thread if the ring is full.
+   the record is written once it is filled in and output_push is called */
+output_record* output_slot(output_writer* output) {
+#ifdef ASYNC_OUTPUT
+    if (output->async && output->pushed - output->written == OUTPUT_RING_SIZE) {
+        while ((output->written = atomic_load_explicit(&output->written_index, memory_order_acquire)) + OUTPUT_RING_SIZE == output->pushed) {
+            sched_yield(); /* backpressure: wait for the writer thread */
+        }
+    }
+#endif
+    return &output->ring[output->pushed & (OUTPUT_RING_SIZE - 1)];
+}
+void output_push(output_writer* output) {
+    output->pushed++;
+#ifdef ASYNC_OUTPUT
+    if (output->async) {
+        atomic_store_explicit(&output->pushed_index, output->pushed, memory_order_release);
+        return;
+    }
+#endif
+    write_output_record(output, &output->ring[(output->pushed - 1) & (OUTPUT_RING_SIZE - 1)]);
+    output->written = output->pushed;
+}
+
+/* pushes a trace line, unless the trace is off (the JIT doesn't write it, and nothing is written before open_output) */
+void update_trace(int PC, uint32_t instruction, int* registers, output_writer* output) {
+    output_record* record;
+    if (!output->trace_enabled) {
+        return;
+    }
+    record = output_slot(output);
+    record->type = OUTPUT_TRACE;
+    record->data.trace.PC = PC;
+    record->data.trace.instruction = instruction;
+    memcpy(record->data.trace.registers, registers, sizeof(record->data.trace.registers));
+    output_push(output);
+}
+
+/* pushes a hwregtrace, leds or display7seg line */
+void update_io_output(output_writer* output, int type, int clock_cycle_counter, int io_reg_num, int value) {
+    output_record* record;
+    if (output->ring == NULL) {
+        return; /* not opened */
+    }
+    record = output_slot(output);
+    record->type = type;
+    record->data.io.clock_cycle_counter = clock_cycle_counter;
+    record->data.io.io_reg_num = io_reg_num;
+    record->data.io.value = value;
+    output_push(output);
+}
+void update_hwregtrace(int* io_registers, int clock_cycle_counter, char* command, int io_reg_num, output_writer* output) {
+    update_io_output(output, strcmp(command, "WRITE") == 0 ? OUTPUT_HWREGTRACE_WRITE : OUTPUT_HWREGTRACE_READ,
+        clock_cycle_counter, io_reg_num, io_registers[io_reg_num]);
+}
+
+/* pushes again the records pushed since first_record, iterations times, with their clocks period cycles later each
+   time. returns false if they are no longer all in the ring */
+bool repeat_output_records(output_writer* output, unsigned first_record, int iterations, int period) {
+    unsigned count = output->pushed - first_record, i;
+    output_record* records, * record;
+    int iteration;
+
+    if (output->ring == NULL) {
+        return true;
+    }
+    if (count > OUTPUT_RING_SIZE / 2) {
+        return false;
+    }
+    records = malloc((count + 1) * sizeof(output_record));
+    if (records == NULL) {
+        printf("An Error Has Occurred With The Output\n");
+        exit(1);
+    }
+    for (i = 0; i < count; i++) {
+        records[i] = output->ring[(first_record + i) & (OUTPUT_RING_SIZE - 1)];
+    }
+    for (iteration = 1; iteration <= iterations; iteration++) {
+        for (i = 0; i < count; i++) {
+            record = output_slot(output);
+            *record = records[i];
+            if (record->type != OUTPUT_TRACE) {
+                record->data.io.clock_cycle_counter += iteration * period;
+            }
+            output_push(output);
+        }
+    }
+    free(records);
+    return true;
+}
+
+/* opens an output trace file. binary files start with magic */
+void open_trace_writer(trace_writer* writer, char* filename, char* magic, bool binary) {
+    open_output_file(&writer->file, filename, binary);
+    writer->binary = binary;
+    memset(writer->registers, 0, sizeof(writer->registers)); /* tracedec also starts from zeroed registers */
+    if (binary) {
+        memcpy(writer->file.buffer, magic, TRACE_MAGIC_SIZE);
+        writer->file.used = TRACE_MAGIC_SIZE;
+    }
+}
+
+/* opens the output files and starts the writer thread if async */
+void open_output(output_writer* output, char* trace_filename, char* hwregtrace_filename, char* leds_filename,
+    char* display7seg_filename, bool binary_trace, bool async) {
+    open_trace_writer(&output->trace_file, trace_filename, TRACE_MAGIC, binary_trace);
+    open_trace_writer(&output->hwregtrace_file, hwregtrace_filename, HWREGTRACE_MAGIC, binary_trace);
+    open_output_file(&output->leds_file, leds_filename, false);
+    open_output_file(&output->display7seg_file, display7seg_filename, false);
+    output->trace_enabled = true;
+    output->ring = malloc(OUTPUT_RING_SIZE * sizeof(output_record));
+    if (output->ring == NULL) {
+        printf("An Error Has Occurred With The Output\n");
+        exit(1);
+    }
+    output->pushed = 0;
+    output->written = 0;
+    output->async = false;
+#ifdef ASYNC_OUTPUT
+    atomic_init(&output->pushed_index, 0);
+    atomic_init(&output->written_index, 0);
+    atomic_init(&output->done, false);
+    if (async && pthread_create(&output->thread, NULL, output_thread, output) == 0) {
+        output->async = true;
+    }
+#endif
+}
+
+/* an output that writes nothing, until open_output */
+void initialize_output(output_writer* output) {
+    output->trace_enabled = false;
+    output->ring = NULL;
+    output->pushed = 0;
+    output->written = 0;
+    output->async = false;
+}
+
+/* waits for the writer thread to write everything and closes the output files */
+void close_output(output_writer* output) {
+    if (output->ring == NULL) {
+        return;
+    }
+#ifdef ASYNC_OUTPUT
+    if (output->async) {
+        atomic_store_explicit(&output->done, true, memory_order_release);
+        pthread_join(output->thread, NULL);
+    }
+#endif
+    close_output_file(&output->trace_file.file);
+    close_output_file(&output->hwregtrace_file.file);
+    close_output_file(&output->leds_file);
+    close_output_file(&output->display7seg_file);
+    free(output->ring);
+    initialize_output(output);
 }
 
+/* close the output files: trace, hwregtrace, leds, display7seg
+   release the disk image and finally free the irq2 events. */
+void close_files_and_free_memory(output_writer* output, disk_image* disk, irq2_events* irq2) {
+    /* close files */
+    close_output(output);
+
+    /* free the memory of all the arrays we define */
+    free_disk(disk);
+    free_irq2_events(irq2);
+}
+
+/**************************************************************/
+/**************** Functions for each iteration ****************/
+/**************************************************************/
 
-/* instruction implementations */
 void add_instruction(int* registers, int rd, int rs, int rt) {
     if (rd != 0) {
         registers[rd] = registers[rs] + registers[rt];
@@ -547,77 +1811,82 @@ void jal_instruction(int* registers, int* PC, int rd, int rs) {
     registers[rd] = *PC;
     *PC = registers[rs];
 }
-void lw_instruction(int *registers, char** main_memory, int rd, int rs, int rt, int *clock_cycle_counter) {
+void lw_instruction(int *registers, uint32_t* main_memory, int rd, int rs, int rt, int *clock_cycle_counter) {
     int temp = registers[rs] + registers[rt];
     temp = mod(temp, MAIN_MEMORY_DEPTH); /* limiting address of data memory to be between 0 and 4095 */
-    registers[rd] = hex_to_int(main_memory[temp]);
+    registers[rd] = main_memory[temp];
 	(*clock_cycle_counter)++; /* increment cycle for memory access */
 }
-void sw_instruction(int* registers, char** main_memory, int rd, int rs, int rt, int *clock_cycle_counter) {
+void sw_instruction(int* registers, uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, int rd, int rs, int rt, int *clock_cycle_counter) {
     int temp = registers[rs] + registers[rt];
     temp = mod(temp, MAIN_MEMORY_DEPTH); /* limiting address of data memory to be between 0 and 4095 */
-    int_to_mem_word(registers[rd], main_memory[temp]);
+    main_memory[temp] = registers[rd] & MEMWORD_MASK; /* only the lower 20 bits are stored */
+    redecode_main_memory(main_memory, decoded_memory, dirty, temp, 1); /* the stored word may be code */
 	(*clock_cycle_counter)++; /* increment cycle for memory access */
 }
 void reti_instruction(int* io_registers, int* PC, bool* executing_ISR) {
     *PC = io_registers[7];
 	*executing_ISR = false;
 }
-void in_instruction(int *registers, int *io_registers, int rd, int rs, int rt, int clock_cycle_counter, FILE* hwregtrace_file) {
+void in_instruction(int *registers, int *io_registers, int rd, int rs, int rt, int clock_cycle_counter, output_writer* output) {
     int sum = registers[rs] + registers[rt];
     sum = mod(sum, NUM_OF_IO_REGISTERS); /* make sure sum fits to io_registers[23] */
     registers[rd] = io_registers[sum];
-    update_hwregtrace(io_registers, clock_cycle_counter, "READ", sum, hwregtrace_file);
+    update_hwregtrace(io_registers, clock_cycle_counter, "READ", sum, output);
 }
-void out_instruction(int *registers, int *io_registers, int rd, int rs, int rt, int clock_cycle_counter, FILE* trace_file, FILE* hwregtrace_file, FILE* leds_file, FILE* display7seg_file, char** monitor) {
+void out_instruction(int *registers, int *io_registers, int rd, int rs, int rt, int clock_cycle_counter, output_writer* output, uint8_t* monitor, dirty_map* dirty,
+    disk_image* disk) {
     int sum = registers[rs] + registers[rt];
     sum = mod(sum, NUM_OF_IO_REGISTERS); /* make sure sum fits to io_registers[23] */
     io_registers[sum] = registers[rd];
-    update_hwregtrace(io_registers, clock_cycle_counter, "WRITE", sum, hwregtrace_file);
+    update_hwregtrace(io_registers, clock_cycle_counter, "WRITE", sum, output);
     if (sum == LEDS) {  /* leds case */
-        fprintf(leds_file, "%d %08X\n", clock_cycle_counter, io_registers[sum]); 
+        update_io_output(output, OUTPUT_LEDS, clock_cycle_counter, sum, io_registers[sum]);
     }
     if (sum == DISPLAY7SEG) { /* display7seg case */
-        fprintf(display7seg_file, "%d %08X\n", clock_cycle_counter, io_registers[sum]);
+        update_io_output(output, OUTPUT_DISPLAY7SEG, clock_cycle_counter, sum, io_registers[sum]);
     }
     if (sum == MONITORCMD) { /* monitorcmd case */
         if (io_registers[sum] == 1) { /* if a pixel on the monitor is updated */
-            int_to_monitor_word(io_registers[MONITOR_DATA], monitor[io_registers[MONITOR_ADDR]]); /* updates the pixel on the monitor */
+            int pixel = mod(io_registers[MONITOR_ADDR], MONITOR_PIXELS);
+            monitor[pixel] = io_registers[MONITOR_DATA] & 0xff; /* updates the pixel on the monitor (lower 8 bits) */
+            DIRTY_MARK(dirty->monitor, pixel);
+            if (pixel >= dirty->monitor_end) {
+                dirty->monitor_end = pixel + 1;
+            }
         }
         io_registers[sum] = 0;
     }
     if (sum == DISKCMD) { /* diskcmd case */
         if (io_registers[sum] == 1 || io_registers[sum] == 2) { /* if diskcmd was set to read or write */
+            if (io_registers[DISK_STATUS] == FREE) {
+                start_disk_timing(disk, io_registers[DISK_SECTOR], clock_cycle_counter);
+            }
             io_registers[DISK_STATUS] = 1; /* set diskstatus as busy */
         }
     }
+    if (sum == DISK_QUEUE) { /* diskqueue case */
+        disk_enqueue(disk, io_registers, clock_cycle_counter);
+    }
 }
 
 /* execute an instruction */
-void execute_instruction(char** main_memory, char** disk, char** monitor, int* PC, int* registers, int* io_registers,
+void execute_instruction(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, uint8_t* monitor, int* PC, int* registers, int* io_registers,
 	int *clock_cycle_counter, bool *halt, bool* executing_ISR,
-	FILE* trace_file, FILE* hwregtrace_file, FILE* leds_file, FILE* display7seg_file) {
+	output_writer* output) {
     
-    char* instruction = main_memory[*PC];
+    uint32_t instruction = main_memory[*PC];
 
-    bool is_immediate = false;
-    int opcode, rd, rs, rt, imm;
-    
-    /* extracts from the instruction (hex in string) the values of the registers rd, rt, rs and opcode */
-    get_registers_values_from_hex_string_instruction(main_memory[*PC], &rt, &rs, &rd, &opcode);
-    /* make sure the registers values fit to the registers_array */
-    if (rs >= NUM_OF_REGISTERS) { rs = mod(rs, NUM_OF_REGISTERS); }
-    if (rt >= NUM_OF_REGISTERS) { rt = mod(rt, NUM_OF_REGISTERS); }
-    if (rd >= NUM_OF_REGISTERS) { rd = mod(rd, NUM_OF_REGISTERS); }
+    /* the instruction fields were extracted when the word was loaded or last written */
+    decoded_instruction* decoded = &decoded_memory[*PC];
+    bool is_immediate = decoded->is_immediate;
+    int opcode = decoded->opcode, rd = decoded->rd, rs = decoded->rs, rt = decoded->rt;
     
-    /* check if it's an isntraction with imm */
-    is_immediate = imm_instruction(rd, rs, rt); 
-    if (is_immediate) { /* isntraction with $imm, get the next line (the imm value) */
-        imm = get_imm_from_memory_word(main_memory[*PC + 1]);
-        registers[1] = imm; /* load imm to reg[1] ($imm) */
+    if (is_immediate) { /* isntraction with $imm */
+        registers[1] = decoded->imm; /* load imm to reg[1] ($imm) */
     }
 
-    update_trace(*PC, instruction, registers, trace_file);
+    update_trace(*PC, instruction, registers, output);
 
     /* every isntraction take at least one PC and One clock cycle
        if it's an instraction with Imm we alredy increase the PC and the clock_cycle_cunter by one */
@@ -648,10 +1917,10 @@ void execute_instruction(char** main_memory, char** disk, char** monitor, int* P
     case 14: /* bge */  bge_instruction(registers, PC, rd, rs, rt);  break;
     case 15: /* jal */  jal_instruction(registers, PC, rd, rs);  break;
     case 16: /* lw */   lw_instruction(registers, main_memory, rd, rs, rt, clock_cycle_counter);   break;
-    case 17: /* sw */   sw_instruction(registers, main_memory, rd, rs, rt, clock_cycle_counter);   break;
+    case 17: /* sw */   sw_instruction(registers, main_memory, decoded_memory, dirty, rd, rs, rt, clock_cycle_counter);   break;
     case 18: /* reti */ reti_instruction(io_registers, PC, executing_ISR); break;
-    case 19: /* in */   in_instruction(registers, io_registers, rd, rs, rt, *clock_cycle_counter, hwregtrace_file);   break;
-    case 20: /* out */  out_instruction(registers, io_registers, rd, rs, rt, *clock_cycle_counter, trace_file, hwregtrace_file, leds_file, display7seg_file, monitor);  break;
+    case 19: /* in */   in_instruction(registers, io_registers, rd, rs, rt, *clock_cycle_counter, output);   break;
+    case 20: /* out */  out_instruction(registers, io_registers, rd, rs, rt, *clock_cycle_counter, output, monitor, dirty, disk);  break;
     case 21: /* halt */ *halt = true; break;
     }
 }
@@ -666,45 +1935,92 @@ void irq_check(int *io_registers, int *PC, bool *executing_ISR) {
     }
 }
 
-/* checks if the disk is busy reading/writing and perform a read/write operation if it is time to do so */
-void disk_check(char** main_memory, char** disk, int* io_registers, int cycles_diff) {
-    static int disk_copy_index = 0;
-	static int disk_timer = 0;
+/* moves the words of the running command from words_moved up to words: reads copy them from the sector to the buffer
+   and writes from the buffer to the sector. limiting the sector and buffer addresses like lw/sw do. a buffer that runs
+   past the end of main memory wraps around to its start, so the words are moved in up to two pieces */
+void disk_transfer(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, disk_command* command, int words) {
+    int sector_num = mod(command->sector, DISK_SECTORS), buffer = mod(command->buffer, MAIN_MEMORY_DEPTH);
+    int first = disk->words_moved, address, length;
+    uint32_t* sector;
+
+    if (command->command == READ && first < words) {
+        sector = load_disk_sector(disk, sector_num);
+        disk->read_address = mod(buffer + first, MAIN_MEMORY_DEPTH);
+        disk->words_read += words - first;
+    }
+    else if (command->command == WRITE && first < words) {
+        /* a sector that is only partly written keeps the rest of its words */
+        sector = first == 0 && words == LINES_PER_SECTOR ? overwrite_disk_sector(disk, sector_num) : load_disk_sector(disk, sector_num);
+        DIRTY_MARK(dirty->sectors, sector_num);
+    }
+    else {
+        first = words;
+    }
+    while (first < words) {
+        address = mod(buffer + first, MAIN_MEMORY_DEPTH);
+        length = words - first;
+        if (address + length > MAIN_MEMORY_DEPTH) {
+            length = MAIN_MEMORY_DEPTH - address;
+        }
+        if (command->command == READ) {
+            memcpy(&main_memory[address], &sector[first], length * sizeof(uint32_t));
+            redecode_main_memory(main_memory, decoded_memory, dirty, address, length); /* a read may have overwritten code */
+        }
+        else {
+            memcpy(&sector[first], &main_memory[address], length * sizeof(uint32_t));
+        }
+        first += length;
+    }
+    disk->words_moved = words;
+}
+
+/* checks if the disk is busy reading/writing and perform a read/write operation if it is time to do so.
+   a command from diskqueue uses the sector and buffer it was queued with, a command from diskcmd the current disksector
+   and diskbuffer. when a command finishes, the next command in the queue starts right away */
+void disk_check(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, int* io_registers,
+    int clock_cycle_counter, int cycles_diff) {
+    disk_command command = disk->queue.current;
 
     /* if disk is busy reading/writing */
     if (io_registers[DISK_STATUS] == BUSY) {
-        /* check if disk finished writing/reading, which takes 1024 cycles */
-        if (disk_timer >= DISK_R_W_TIME) {
-			for (int i = 0; i < LINES_PER_SECTOR; i++)
-			{
-				/* read - copy chosen sector to the address of the buffer in the data memory */
-				if (io_registers[DISKCMD] == READ) {
-					strcpy(main_memory[io_registers[DISK_BUFFER] + i], disk[LINES_PER_SECTOR * io_registers[DISK_SECTOR] + i]);
-				}
-				/* write - write to the chosen sector in the disk the data saved in the address of the buffer in the data memory */
-				if (io_registers[DISKCMD] == WRITE) {
-					strcpy(disk[LINES_PER_SECTOR * io_registers[DISK_SECTOR] + i], main_memory[io_registers[DISK_BUFFER] + i]);
-				}
-			}
-            disk_timer = 0;                                   /* reset timer*/
+        if (!disk->queue.running) {
+            command.command = io_registers[DISKCMD];
+            command.sector = io_registers[DISK_SECTOR];
+            command.buffer = io_registers[DISK_BUFFER];
+        }
+        /* check if disk finished writing/reading, which takes disk->duration cycles */
+        if (disk->timer >= disk->duration) {
+            disk_transfer(main_memory, decoded_memory, dirty, disk, &command, LINES_PER_SECTOR);
+            io_registers[DISK_DONE]++;                        /* diskdone counts the finished commands */
+            disk->timer = 0;                                  /* reset timer*/
             io_registers[IRQ1_STATUS] = FINISH_READ_OR_WRITE; /* irq1status indicate the disk has finished reading/writing */
             io_registers[DISKCMD] = NO_COMMAND;               /* diskcmd set to no command */
             io_registers[DISK_STATUS] = FREE;                 /* diskstatus set to available */
+            disk->queue.running = false;
+            if (disk->queue.count > 0) {
+                start_queued_disk_command(disk, io_registers, clock_cycle_counter);
+            }
         }
-        /* increment the timer which counts the cycles of a disk read/write command */
+        /* increment the timer which counts the cycles of a disk read/write command, and move the words whose time came */
         else {
-            disk_timer += cycles_diff;
+            disk->timer += cycles_diff;
+            if (disk->timing->incremental && disk->timer >= disk_event_time(disk)) {
+                disk_transfer(main_memory, decoded_memory, dirty, disk, &command, disk->timing->word == 0 ? LINES_PER_SECTOR :
+                    LINES_PER_SECTOR - (disk->duration - disk->timer + disk->timing->word - 1) / disk->timing->word);
+            }
         }
     }
 }
 
-/* updates irq2status as set by the irq2in input file */
-void irq2status_check(int* irq2cycles_array, int* io_registers, int clock_cycle_counter) {
-	static irq2_index = 0;
+/* updates irq2status as set by irq2in (or its generator) */
+void irq2status_check(irq2_events* irq2, int* io_registers, int clock_cycle_counter) {
     /* if current clock cycle is set to turn on irq2status */
-    if (clock_cycle_counter >= irq2cycles_array[irq2_index]) {
+    if (irq2->next < irq2->count && clock_cycle_counter >= irq2->cycles[irq2->next]) {
         io_registers[IRQ2_STATUS] = 1;
-        irq2_index += 1;
+        irq2->raised += 1;
+        if (++irq2->next == irq2->count) {
+            read_irq2_events(irq2); /* the events read ahead were all raised */
+        }
     }
 }
 
@@ -721,106 +2037,3027 @@ void timerenable_check(int *io_registers, int cycles_diff) {
     }
 }
 
+/* updates the devices and the interrupt state after an instruction which took cycles_diff clock cycles */
+void update_devices(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, irq2_events* irq2, int* io_registers,
+    int clock_cycle_counter, int cycles_diff, int* PC, bool* executing_ISR) {
+    irq2status_check(irq2, io_registers, clock_cycle_counter);
+    disk_check(main_memory, decoded_memory, dirty, disk, io_registers, clock_cycle_counter, cycles_diff);
+    timerenable_check(io_registers, cycles_diff);
+    irq_check(io_registers, PC, executing_ISR);
+    io_registers[CLOCK_CYCLE_COUNTER] = clock_cycle_counter; // updating the number of clock cycles in the designated I/O register 
+}
 
-/* go over instruction memory and execute the instructions of the program */
-void run_program(char* memin_filename, char* diskin_filename, char* irq2in_filename, char* memout_filename, char* regout_filename, char* trace_filename, char* hwregtrace_filename,
-    char* cycles_filename, char* leds_filename, char* display7seg_filename, char* diskout_filename, char* monitortxt_filename) {
+/**************************************************************/
+/************************ device scheduler ********************/
+/**************************************************************/
 
-    /* all the files we update every iteration initialize as NULL */
-    FILE* trace_file = NULL, * hwregtrace_file = NULL, * leds_file = NULL, * display7seg_file = NULL;
-    
-    /* array of strings representing the main memory, disk and monitor */
-    char* main_memory[MAIN_MEMORY_DEPTH];  
-    char* disk[DISK_SECTORS * LINES_PER_SECTOR];
-    char* monitor[MONITOR_PX_DIM * MONITOR_PX_DIM];
-
-	/* array representing the cycles when irq2 is raised */
-	int* irq2cycles_array;
-
-	/* arrays of the regular and i/o registers */
-	int registers[NUM_OF_REGISTERS], io_registers[NUM_OF_IO_REGISTERS];
-
-	/* important status integers and booleans */
-	int PC = 0, clock_cycle_counter = 0;
-	bool executing_ISR = false, halt = false;
-
-    /* load data from files: memin, diskin, irq2in and create black monitor.
-       initialize the arrays: main_memory, monitor, disk, irq2in_array
-       and put ziroes in registers and io_registers arrays  */
-    initialize_main_memory(main_memory, memin_filename);
-    initialize_disk(disk, diskin_filename);
-    initialize_monitor(monitor);
-    irq2cycles_array = initialize_irq2in_array(irq2in_filename);
-    initialize_registers(registers, io_registers);
+/* instead of running the device checks after every instruction, the engines only run update_devices when the clock
+   reaches the earliest cycle in the scheduler, a small priority queue with the next event of every device.
+   between events the devices only count cycles, so timercurrent, the disk timer and clockcyclecounter are brought
+   up to date lazily (sync_devices): before an in or out instruction reads or writes them and before an event.
+   in, out and reti may change the state of the devices and the interrupts, so they schedule EVENT_IO right away */
 
-    /* opening (and checking) the files: trace, hwregtrace, leds, display7seg in write mode */
-	trace_file = fopen(trace_filename, "w");
-    open_file_check(trace_filename, trace_file);
-    hwregtrace_file = fopen(hwregtrace_filename, "w");
-    open_file_check(hwregtrace_filename, hwregtrace_file);
-    leds_file = fopen(leds_filename, "w");
-    open_file_check(leds_filename, leds_file);
-    display7seg_file = fopen(display7seg_filename, "w");
-    open_file_check(display7seg_filename, display7seg_file);
-    
-    /* only halt instruction will stop the program */
-    while (!halt) {
-		int clock_cycle_before = clock_cycle_counter;
-        execute_instruction(main_memory, disk, monitor, &PC, registers, io_registers,
-			&clock_cycle_counter, &halt, &executing_ISR,
-			trace_file, hwregtrace_file, leds_file, display7seg_file);
-		int cycles_diff = clock_cycle_counter - clock_cycle_before;
-
-		irq2status_check(irq2cycles_array, io_registers, clock_cycle_counter);
-		disk_check(main_memory, disk, io_registers, cycles_diff);
-		timerenable_check(io_registers, cycles_diff);
-		irq_check(io_registers, &PC, &executing_ISR);
-        io_registers[CLOCK_CYCLE_COUNTER] = clock_cycle_counter; // updating the number of clock cycles in the designated I/O register 
+/* clamps a cycle computed from i/o registers, which may be far away, to the range of the clock */
+int clamp_event_cycle(long long cycle) {
+    if (cycle > INT32_MAX) {
+        return INT32_MAX;
     }
-    
-    /* create the output files: memout, regout, monitor.txt, cycles */
-    create_memout(main_memory, memout_filename);
-    create_regout(registers, regout_filename);
-    create_diskout(disk, diskout_filename);
-    create_monitor_txt(monitor, monitortxt_filename);
-    create_cycles(clock_cycle_counter, cycles_filename);
-   
-    /* close the file: trace, hwregtrace, leds, display7seg
-       free tha arrays we define: instructions_memory, memout, disk, monitor, irq2cycles_array
-       free the memory of the files: memin, diskin, irq2in, memout, regout, trace, hwregtrace,
-       cycles, leds, display7seg, diskout ,monitortxt */
-    close_files_and_free_memory(trace_file, hwregtrace_file, leds_file, display7seg_file, main_memory, disk, monitor, irq2cycles_array);
+    if (cycle < INT32_MIN) {
+        return INT32_MIN;
+    }
+    return (int)cycle;
 }
 
- 
-/******* main ********/
-int main(int argc, char* argv[]) {
-    
-    char* memin_filename, * diskin_filename, * irq2in_filename, * memout_filename, * regout_filename, * trace_filename, * hwregtrace_filename,
-        * cycles_filename, * leds_filename, * display7seg_filename, * diskout_filename, * monitortxt_filename;
+/* swaps two entries of the heap */
+void scheduler_swap(device_scheduler* scheduler, int i, int j) {
+    int cycle = scheduler->cycles[i], event = scheduler->events[i];
+    scheduler->cycles[i] = scheduler->cycles[j];
+    scheduler->events[i] = scheduler->events[j];
+    scheduler->cycles[j] = cycle;
+    scheduler->events[j] = event;
+    scheduler->positions[scheduler->events[i]] = i;
+    scheduler->positions[scheduler->events[j]] = j;
+}
 
-    if (argc == 13) {
-        memin_filename = argv[1];
-        diskin_filename = argv[2];
-        irq2in_filename = argv[3];
-        memout_filename = argv[4];
-        regout_filename = argv[5];
-        trace_filename = argv[6];
-        hwregtrace_filename = argv[7];
-        cycles_filename = argv[8];    
-        leds_filename = argv[9];      
-        display7seg_filename = argv[10]; 
-        diskout_filename = argv[11];     
-        monitortxt_filename = argv[12]; 
+/* sets the cycle of an event (NO_EVENT if it won't happen) and restores the heap order */
+void schedule_event(device_scheduler* scheduler, int event, int cycle) {
+    int i = scheduler->positions[event], child;
+    scheduler->cycles[i] = cycle;
+    while (i > 0 && scheduler->cycles[(i - 1) / 2] > scheduler->cycles[i]) {
+        scheduler_swap(scheduler, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < NUM_OF_EVENTS) {
+        if (child + 1 < NUM_OF_EVENTS && scheduler->cycles[child + 1] < scheduler->cycles[child]) {
+            child++;
+        }
+        if (scheduler->cycles[child] >= scheduler->cycles[i]) {
+            break;
+        }
+        scheduler_swap(scheduler, i, child);
+        i = child;
+    }
+}
+
+/* the earliest cycle in which update_devices has to run */
+int next_event_cycle(device_scheduler* scheduler) {
+    return scheduler->cycles[0];
+}
+
+/* brings timercurrent, the disk timer and clockcyclecounter up to date with the clock, as if update_devices ran
+   after every instruction since the last sync without any event happening */
+void sync_devices(device_scheduler* scheduler, disk_image* disk, int* io_registers, int clock_cycle_counter) {
+    int cycles_diff = clock_cycle_counter - scheduler->synced_clock_cycle_counter;
+    if (io_registers[TIMERENABLE] == 1) {
+        io_registers[TIMERCURRENT] += cycles_diff;
+    }
+    if (io_registers[DISK_STATUS] == BUSY) {
+        disk->timer += cycles_diff;
+    }
+    io_registers[CLOCK_CYCLE_COUNTER] = clock_cycle_counter;
+    scheduler->synced_clock_cycle_counter = clock_cycle_counter;
+}
+
+/* computes the next event of every device from the (synced) i/o registers. the cycles are the earliest clock in
+   which the check of the device in update_devices could do more than count cycles */
+void schedule_devices(device_scheduler* scheduler, disk_image* disk, irq2_events* irq2, int* io_registers) {
+    long long clock_cycle_counter = scheduler->synced_clock_cycle_counter;
+    schedule_event(scheduler, EVENT_IRQ2, irq2->next < irq2->count ? irq2->cycles[irq2->next] : NO_EVENT);
+    schedule_event(scheduler, EVENT_DISK, io_registers[DISK_STATUS] == BUSY ?
+        clamp_event_cycle(clock_cycle_counter + disk_event_time(disk) - disk->timer) : NO_EVENT);
+    schedule_event(scheduler, EVENT_TIMER, io_registers[TIMERENABLE] == 1 ?
+        clamp_event_cycle(clock_cycle_counter + (long long)io_registers[TIMERMAX] - io_registers[TIMERCURRENT]) : NO_EVENT);
+    schedule_event(scheduler, EVENT_IO, NO_EVENT);
+}
+
+/* initializes the scheduler with the devices as they are at the given clock */
+void initialize_scheduler(device_scheduler* scheduler, disk_image* disk, irq2_events* irq2, int* io_registers, int clock_cycle_counter) {
+    int i;
+    for (i = 0; i < NUM_OF_EVENTS; i++) {
+        scheduler->cycles[i] = NO_EVENT;
+        scheduler->events[i] = i;
+        scheduler->positions[i] = i;
+    }
+    scheduler->synced_clock_cycle_counter = clock_cycle_counter;
+    schedule_devices(scheduler, disk, irq2, io_registers);
+}
+
+/* called before a reti, in or out instruction, which starts at the given clock */
+void io_access_event(device_scheduler* scheduler, disk_image* disk, int* io_registers, int clock_cycle_counter) {
+    sync_devices(scheduler, disk, io_registers, clock_cycle_counter);
+    schedule_event(scheduler, EVENT_IO, INT32_MIN);
+}
+
+/* called after every instruction, which ran from clock_cycle_before to clock_cycle_counter. runs update_devices
+   if an event is due and schedules the next events */
+void scheduled_update_devices(device_scheduler* scheduler, uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk,
+    irq2_events* irq2, int* io_registers, int clock_cycle_before, int clock_cycle_counter, int* PC, bool* executing_ISR) {
+    if (clock_cycle_counter >= next_event_cycle(scheduler)) {
+        sync_devices(scheduler, disk, io_registers, clock_cycle_before);
+        update_devices(main_memory, decoded_memory, dirty, disk, irq2, io_registers,
+            clock_cycle_counter, clock_cycle_counter - clock_cycle_before, PC, executing_ISR);
+        scheduler->synced_clock_cycle_counter = clock_cycle_counter;
+        schedule_devices(scheduler, disk, irq2, io_registers);
+    }
+}
+
+/**************************************************************/
+/************************** idle loops ************************/
+/**************************************************************/
+
+/* programs wait for the devices in polling loops, like the in diskstatus + bne loops of disktest. an iteration of a
+   loop is taken from one in instruction back to the same instruction. if no sw or out ran during it and the state is
+   the same at both ends, except for the clock and the counters (timercurrent, the disk timer and clockcyclecounter),
+   every following iteration does exactly the same until the next device event. so the clock skips straight over the
+   whole iterations before that event, pushing again the output records of the iteration for each skipped one.
+   in instructions reading clockcyclecounter or timercurrent see a different value on every iteration, so loops with
+   them are never skipped */
+
+/* the number of the i/o register read by an in instruction, with $imm loaded as the instruction will load it */
+int in_register_num(decoded_instruction* decoded, int* registers) {
+    int rs_value = decoded->rs == IMM_REG ? decoded->imm : registers[decoded->rs];
+    int rt_value = decoded->rt == IMM_REG ? decoded->imm : registers[decoded->rt];
+    return mod(rs_value + rt_value, NUM_OF_IO_REGISTERS);
+}
+
+/* true iff the state is the one saved when the iteration started, except for the clock and the counters */
+bool idle_loop_same_state(idle_loop_detector* idle, irq2_events* irq2, int* registers, int* io_registers, bool executing_ISR) {
+    int i;
+    for (i = 0; i < NUM_OF_IO_REGISTERS; i++) {
+        if (i != CLOCK_CYCLE_COUNTER && i != TIMERCURRENT && io_registers[i] != idle->io_registers[i]) {
+            return false;
+        }
+    }
+    return memcmp(registers, idle->registers, sizeof(idle->registers)) == 0 &&
+        executing_ISR == idle->executing_ISR && irq2->raised == idle->irq2_raised;
+}
+
+/* starts a new iteration at the in instruction at PC */
+void idle_loop_start(idle_loop_detector* idle, irq2_events* irq2, int* registers, int* io_registers, bool executing_ISR,
+    int PC, int clock_cycle_counter, long long instructions, output_writer* output) {
+    idle->armed = true;
+    idle->PC = PC;
+    idle->clock_cycle_counter = clock_cycle_counter;
+    idle->instructions = instructions;
+    idle->first_record = output->pushed;
+    memcpy(idle->registers, registers, sizeof(idle->registers));
+    memcpy(idle->io_registers, io_registers, sizeof(idle->io_registers));
+    idle->executing_ISR = executing_ISR;
+    idle->irq2_raised = irq2->raised;
+}
+
+/* called before the in instruction at PC, which starts at the given clock, runs. returns the number of cycles
+   skipped, which the caller adds to the clock before running the instruction. the instructions of the skipped
+   iterations are added to *instructions */
+int idle_loop_check(idle_loop_detector* idle, device_scheduler* scheduler, irq2_events* irq2, decoded_instruction* decoded,
+    int* registers, int* io_registers, bool executing_ISR, int PC, int clock_cycle_counter, long long* instructions, output_writer* output) {
+    int io_reg_num = in_register_num(decoded, registers);
+    int period = clock_cycle_counter - idle->clock_cycle_counter;
+    int skipped_cycles = 0, iterations;
+    long long cycles_to_event;
+
+    if (!idle->enabled) {
+        return 0;
+    }
+    if (io_reg_num == CLOCK_CYCLE_COUNTER || io_reg_num == TIMERCURRENT) {
+        idle->armed = false;
+        return 0;
+    }
+    if (idle->armed && period <= IDLE_LOOP_MAX_CYCLES) {
+        if (PC != idle->PC) {
+            return 0; /* another in in the same iteration */
+        }
+        if (idle_loop_same_state(idle, irq2, registers, io_registers, executing_ISR) && next_event_cycle(scheduler) != NO_EVENT) {
+            /* the skipped iterations have to end before the cycle of the next event */
+            cycles_to_event = (long long)next_event_cycle(scheduler) - 1 - clock_cycle_counter;
+            iterations = cycles_to_event > 0 ? (int)(cycles_to_event / period) : 0;
+            /* the iteration isn't skipped if its records already left the ring */
+            if (iterations > 0 && repeat_output_records(output, idle->first_record, iterations, period)) {
+                skipped_cycles = iterations * period;
+                *instructions += iterations * (*instructions - idle->instructions);
+            }
+        }
+    }
+    idle_loop_start(idle, irq2, registers, io_registers, executing_ISR, PC, clock_cycle_counter + skipped_cycles, *instructions, output);
+    return skipped_cycles;
+}
+
+/**************************************************************/
+/*************************** profiler *************************/
+/**************************************************************/
+
+/* with -profile the engines count, for every PC, the instructions that ran there and the clock cycles they took
+   (including the $imm word and the memory access of lw and sw), how many times the branch there was taken or not
+   and how many times the jal there was called. idle loops are run instead of skipped so that every iteration is
+   counted, and the JIT gives way to the threaded engine, since translated code doesn't stop to be counted.
+   a symbol map (-symbols, written by asm when it is given a third file name) names the code: of its lines, the
+   "label NAME ADDRESS" ones (the address in hex) are read and the others are skipped. every PC belongs to the nearest label at or before it. with a symbol map the profiler also
+   follows the call paths: a jal enters a frame named after its target, which is left when the PC reaches the word
+   after the jal, and an interrupt enters a frame named after the handler, which is left by reti. the cycles of every
+   call path and label are written in the folded stack format of flame graph tools (-folded) */
+
+#define PROFILE_MAX_DEPTH 64                   /* deepest call path the profiler follows, deeper calls stay in it */
+#define PROFILE_LABEL_SIZE 50                  /* max characters in a label of the symbol map */
+#define PROFILE_NO_LABEL "_start"              /* the name of the code before the first label */
+
+/* what ran at a PC */
+typedef struct {
+    long long instructions, cycles;
+    long long taken, not_taken;               /* beq to bge */
+    long long calls;                          /* jal */
+} pc_profile;
+
+/* a label of the symbol map */
+typedef struct {
+    char name[PROFILE_LABEL_SIZE + 1];
+    int address;
+} profile_label;
+
+/* a call path, from the root (the code outside any call) through the frames of the calls down to its own */
+typedef struct {
+    int parent;                               /* index of the path it was called from, -1 for the root */
+    int entry;                                /* address its frame is named after */
+    int first_child, next_sibling;            /* the paths called from it, -1 if none */
+    long long* cycles;                        /* cycles spent in the path by the label of the PC, num_of_labels + 1 of them */
+} call_path;
+
+typedef struct {
+    pc_profile pcs[MAIN_MEMORY_DEPTH];
+    profile_label* labels;                    /* the symbol map sorted by address, NULL if there is none */
+    int num_of_labels;
+    int label_of[MAIN_MEMORY_DEPTH];          /* index in labels of the label of every PC, num_of_labels before the first */
+    call_path* paths;                         /* the call paths, the root first. NULL without a symbol map */
+    int num_of_paths, paths_capacity;
+    int frame_paths[PROFILE_MAX_DEPTH + 1];   /* the path of every frame the program is in, the root at 0 */
+    int frame_returns[PROFILE_MAX_DEPTH + 1]; /* the address that leaves the frame, -1 for an interrupt */
+    int depth;                                /* index of the innermost frame */
+    int isr_depth;                            /* index of the frame of the interrupt being handled, -1 if none */
+} profiler;
+
+/* orders labels by address */
+int compare_profile_labels(const void* a, const void* b) {
+    return ((const profile_label*)a)->address - ((const profile_label*)b)->address;
+}
+
+/* returns the index of the path called from parent whose frame is named after entry, adding it if it is new */
+int find_call_path(profiler* profile, int parent, int entry) {
+    call_path* path;
+    int i;
+
+    for (i = parent < 0 ? -1 : profile->paths[parent].first_child; i >= 0; i = profile->paths[i].next_sibling) {
+        if (profile->paths[i].entry == entry) {
+            return i;
+        }
+    }
+    if (profile->num_of_paths == profile->paths_capacity) {
+        profile->paths_capacity = profile->paths_capacity == 0 ? 16 : 2 * profile->paths_capacity;
+        profile->paths = realloc(profile->paths, profile->paths_capacity * sizeof(call_path));
+        if (profile->paths == NULL) {
+            printf("An Error Has Occurred With The Profiler\n");
+            exit(1);
+        }
+    }
+    i = profile->num_of_paths++;
+    path = &profile->paths[i];
+    path->parent = parent;
+    path->entry = entry;
+    path->first_child = -1;
+    path->next_sibling = -1;
+    path->cycles = calloc(profile->num_of_labels + 1, sizeof(long long));
+    if (path->cycles == NULL) {
+        printf("An Error Has Occurred With The Profiler\n");
+        exit(1);
+    }
+    if (parent >= 0) {
+        path->next_sibling = profile->paths[parent].first_child;
+        profile->paths[parent].first_child = i;
+    }
+    return i;
+}
+
+/* reads the labels of a symbol map and starts following the call paths */
+void read_symbol_map(profiler* profile, char* symbols_filename) {
+    FILE* symbols_file = fopen(symbols_filename, "r");
+    char line_buffer[MAX_LINE_SIZE + 1], name[PROFILE_LABEL_SIZE + 1];
+    unsigned address;
+    int capacity = 0, i, label, next;
+
+    open_file_check(symbols_filename, symbols_file);
+    while (fgets(line_buffer, MAX_LINE_SIZE + 1, symbols_file)) {
+        if (sscanf(line_buffer, "label %50s %x", name, &address) != 2) {
+            continue;
+        }
+        if (profile->num_of_labels == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            profile->labels = realloc(profile->labels, capacity * sizeof(profile_label));
+            if (profile->labels == NULL) {
+                printf("An Error Has Occurred With The Profiler\n");
+                exit(1);
+            }
+        }
+        strcpy(profile->labels[profile->num_of_labels].name, name);
+        profile->labels[profile->num_of_labels++].address = address % MAIN_MEMORY_DEPTH;
+    }
+    fclose(symbols_file);
+    if (profile->num_of_labels > 0) {
+        qsort(profile->labels, profile->num_of_labels, sizeof(profile_label), compare_profile_labels);
+    }
+
+    label = profile->num_of_labels; /* before the first label */
+    next = 0;
+    for (i = 0; i < MAIN_MEMORY_DEPTH; i++) {
+        while (next < profile->num_of_labels && profile->labels[next].address <= i) {
+            label = next++;
+        }
+        profile->label_of[i] = label;
+    }
+    profile->frame_paths[0] = find_call_path(profile, -1, -1);
+}
+
+/* returns a profiler with no counts, that follows the call paths if there is a symbol map (symbols_filename isn't NULL) */
+profiler* create_profiler(char* symbols_filename) {
+    profiler* profile = calloc(1, sizeof(profiler)); /* no labels, so label_of is all num_of_labels */
+
+    if (profile == NULL) {
+        printf("An Error Has Occurred With The Profiler\n");
+        exit(1);
+    }
+    profile->isr_depth = -1;
+    if (symbols_filename != NULL) {
+        read_symbol_map(profile, symbols_filename);
+    }
+    return profile;
+}
+
+void free_profiler(profiler* profile) {
+    int i;
+    if (profile == NULL) {
+        return;
+    }
+    for (i = 0; i < profile->num_of_paths; i++) {
+        free(profile->paths[i].cycles);
+    }
+    free(profile->paths);
+    free(profile->labels);
+    free(profile);
+}
+
+/* enters the frame of a call to entry that is left when the PC reaches return_address (-1 for an interrupt).
+   returns false if the program is already PROFILE_MAX_DEPTH frames deep */
+bool profile_enter_frame(profiler* profile, int entry, int return_address) {
+    if (profile->depth == PROFILE_MAX_DEPTH) {
+        return false;
+    }
+    profile->frame_paths[profile->depth + 1] = find_call_path(profile, profile->frame_paths[profile->depth], entry);
+    profile->frame_returns[++profile->depth] = return_address;
+    return true;
+}
+
+/* called after the instruction at PC ran and took the given cycles, before the devices and the interrupts are
+   updated. next_PC is where the instruction went and executing_ISR is as the instruction left it */
+void profile_step(profiler* profile, decoded_instruction* decoded, int PC, int next_PC, int cycles, bool executing_ISR) {
+    pc_profile* counts = &profile->pcs[PC];
+    int opcode = decoded->opcode, fallthrough = PC + (decoded->is_immediate ? 2 : 1);
+
+    counts->instructions++;
+    counts->cycles += cycles;
+    if (opcode >= 9 && opcode <= 14) { /* beq to bge. a branch to the next instruction counts as not taken */
+        if (next_PC != fallthrough) {
+            counts->taken++;
+        }
+        else {
+            counts->not_taken++;
+        }
+    }
+    else if (opcode == 15) { /* jal */
+        counts->calls++;
+    }
+    if (profile->paths == NULL) {
+        return;
+    }
+
+    /* the first instruction of an interrupt handler enters its frame. executing_ISR is already false after reti, so
+       a reti that is the first and only instruction of the handler enters it by its opcode */
+    if ((executing_ISR || opcode == 18) && profile->isr_depth < 0 && profile_enter_frame(profile, PC, -1)) {
+        profile->isr_depth = profile->depth;
+    }
+    profile->paths[profile->frame_paths[profile->depth]].cycles[profile->label_of[PC]] += cycles;
+    if (opcode == 15) {
+        profile_enter_frame(profile, next_PC & (MAIN_MEMORY_DEPTH - 1), fallthrough);
+    }
+    else if (opcode == 18 && profile->isr_depth >= 0) { /* reti leaves the interrupt and every call made in it */
+        profile->depth = profile->isr_depth - 1;
+        profile->isr_depth = -1;
+    }
+    else if (profile->depth > 0 && next_PC == profile->frame_returns[profile->depth]) {
+        profile->depth--;
+    }
+}
+
+/* the name of the label with the given index, or of the code before the first label */
+char* profile_label_name(profiler* profile, int label) {
+    return label < profile->num_of_labels ? profile->labels[label].name : PROFILE_NO_LABEL;
+}
+
+/* writes where an address is, as its label and the offset from it (LOOP+2), or the address in hex without a symbol map */
+void write_profile_location(FILE* file, profiler* profile, int address) {
+    int label = profile->label_of[address];
+    int offset = address - (label < profile->num_of_labels ? profile->labels[label].address : 0);
+    if (profile->labels == NULL) {
+        fprintf(file, "%03X", address);
+    }
+    else if (offset == 0) {
+        fprintf(file, "%s", profile_label_name(profile, label));
+    }
+    else {
+        fprintf(file, "%s+%d", profile_label_name(profile, label), offset);
+    }
+}
+
+/* a line of the profile file, a PC or a label */
+typedef struct {
+    int index;
+    long long cycles, instructions;
+} profile_entry;
+
+/* orders the lines of the profile file: most cycles first and then by address */
+int compare_profile_entries(const void* a, const void* b) {
+    const profile_entry* i = a, * j = b;
+    if (i->cycles != j->cycles) {
+        return i->cycles < j->cycles ? 1 : -1;
+    }
+    return i->index - j->index;
+}
+
+/* writes the profile file: with a symbol map, a line for every label (cycles, share of all the cycles and
+   instructions), and then a line for every PC that ran (the same, then the branches taken and not taken, the calls
+   and where the PC is). both are sorted by cycles, most first */
+void write_profile(profiler* profile, char* profile_filename) {
+    FILE* profile_file = fopen(profile_filename, "w");
+    profile_entry* entries = calloc(MAIN_MEMORY_DEPTH + 1, sizeof(profile_entry));
+    long long total_cycles = 0;
+    int i, count;
+    pc_profile* counts;
+
+    open_file_check(profile_filename, profile_file);
+    if (entries == NULL) {
+        printf("An Error Has Occurred With The Profiler\n");
+        exit(1);
+    }
+    for (i = 0; i < MAIN_MEMORY_DEPTH; i++) {
+        total_cycles += profile->pcs[i].cycles;
+    }
+
+    if (profile->labels != NULL) {
+        for (i = 0; i <= profile->num_of_labels; i++) {
+            entries[i].index = i;
+        }
+        for (i = 0; i < MAIN_MEMORY_DEPTH; i++) {
+            entries[profile->label_of[i]].cycles += profile->pcs[i].cycles;
+            entries[profile->label_of[i]].instructions += profile->pcs[i].instructions;
+        }
+        for (i = count = 0; i <= profile->num_of_labels; i++) {
+            if (entries[i].instructions > 0) {
+                entries[count++] = entries[i];
+            }
+        }
+        qsort(entries, count, sizeof(profile_entry), compare_profile_entries);
+        fprintf(profile_file, "# label cycles %%cycles instructions\n");
+        for (i = 0; i < count; i++) {
+            fprintf(profile_file, "%s %lld %.2f%% %lld\n", profile_label_name(profile, entries[i].index), entries[i].cycles,
+                100.0 * entries[i].cycles / total_cycles, entries[i].instructions);
+        }
+    }
+
+    for (i = count = 0; i < MAIN_MEMORY_DEPTH; i++) {
+        if (profile->pcs[i].instructions > 0) {
+            entries[count].index = i;
+            entries[count].cycles = profile->pcs[i].cycles;
+            entries[count++].instructions = profile->pcs[i].instructions;
+        }
+    }
+    qsort(entries, count, sizeof(profile_entry), compare_profile_entries);
+    fprintf(profile_file, "# pc cycles %%cycles instructions taken not-taken calls location\n");
+    for (i = 0; i < count; i++) {
+        counts = &profile->pcs[entries[i].index];
+        fprintf(profile_file, "%03X %lld %.2f%% %lld %lld %lld %lld ", entries[i].index, counts->cycles, 100.0 * counts->cycles / total_cycles,
+            counts->instructions, counts->taken, counts->not_taken, counts->calls);
+        write_profile_location(profile_file, profile, entries[i].index);
+        fprintf(profile_file, "\n");
+    }
+    fclose(profile_file);
+    free(entries);
+}
+
+/* writes the frames of a call path from the root down, each followed by ; */
+void write_call_path_frames(FILE* file, profiler* profile, int path) {
+    if (profile->paths[path].parent < 0) {
+        return;
+    }
+    write_call_path_frames(file, profile, profile->paths[path].parent);
+    write_profile_location(file, profile, profile->paths[path].entry);
+    fprintf(file, ";");
+}
+
+/* writes the folded stacks: a line for every call path and label the cycles were spent in, the frames of the path
+   and the label separated by ; and then the cycles. written only with a symbol map */
+void write_folded_profile(profiler* profile, char* folded_filename) {
+    FILE* folded_file = fopen(folded_filename, "w");
+    int path, label;
+
+    open_file_check(folded_filename, folded_file);
+    for (path = 0; path < profile->num_of_paths; path++) {
+        for (label = 0; label <= profile->num_of_labels; label++) {
+            if (profile->paths[path].cycles[label] > 0) {
+                write_call_path_frames(folded_file, profile, path);
+                fprintf(folded_file, "%s %lld\n", profile_label_name(profile, label), profile->paths[path].cycles[label]);
+            }
+        }
+    }
+    fclose(folded_file);
+}
+
+/**************************************************************/
+/************************* cache model ************************/
+/**************************************************************/
+
+/* -icache and -dcache put a cache between the core and main memory, for instruction fetches (the instruction word and
+   its $imm word) and for lw and sw. a cache only keeps the tags of the lines it holds, main memory still has the data.
+   a hit costs what the fixed cost model charges (a cycle per word fetched and a cycle per memory access) and a miss
+   adds the miss penalty. sw allocates a line like lw does. the penalties are part of the cycles of the instruction,
+   added to the clock before it runs. idle loops are run rather than skipped, since their first iterations
+   may miss where the later ones hit, and the JIT gives way to the threaded engine.
+   a cache is given as sets,ways,line,policy,penalty: the number of sets, the lines in each set, the words in a line
+   (sets and line are powers of 2), the replacement policy (lru, fifo or random) and the cycles a miss adds.
+   a cache holds at most as many lines as main memory has (sets * ways <= MAIN_MEMORY_DEPTH / line) */
+
+#define CACHE_LRU 0                            /* replaces the line that was used last the longest time ago */
+#define CACHE_FIFO 1                           /* replaces the line that was filled first */
+#define CACHE_RANDOM 2
+
+typedef struct {
+    int sets, ways, line_words, policy, miss_penalty;
+} cache_config;
+
+typedef struct {
+    cache_config config;
+    int* tags;                                /* the line of main memory held by every way of every set, -1 if none */
+    uint64_t* stamps;                         /* when every way was last used (lru) or filled (fifo) */
+    uint64_t time;
+    uint64_t random_state;
+    long long accesses[2], misses[2];         /* reads (fetches for the instruction cache) and writes */
+} cache;
+
+typedef struct {
+    cache* icache, * dcache;                  /* NULL if there is none */
+    long long stall_cycles;                   /* cycles added by the misses */
+} cache_model;
+
+/* returns true iff n is a positive power of 2 */
+bool power_of_two(int n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+/* parses sets,ways,line,policy,penalty. returns false if it isn't valid */
+bool parse_cache_config(char* spec, cache_config* config) {
+    char policy[8];
+    int length = 0;
+
+    if (sscanf(spec, "%d,%d,%d,%7[a-z],%d%n", &config->sets, &config->ways, &config->line_words, policy,
+        &config->miss_penalty, &length) != 5 || spec[length] != '\0') {
+        return false;
+    }
+    if (strcmp(policy, "lru") == 0) {
+        config->policy = CACHE_LRU;
+    }
+    else if (strcmp(policy, "fifo") == 0) {
+        config->policy = CACHE_FIFO;
+    }
+    else if (strcmp(policy, "random") == 0) {
+        config->policy = CACHE_RANDOM;
+    }
+    else {
+        return false;
+    }
+    return power_of_two(config->sets) && config->ways > 0 && power_of_two(config->line_words) &&
+        config->line_words <= MAIN_MEMORY_DEPTH && config->miss_penalty >= 0 &&
+        (long long)config->sets * config->ways <= MAIN_MEMORY_DEPTH / config->line_words;
+}
+
+/* returns an empty cache, or NULL if the spec isn't valid */
+cache* create_cache(char* spec) {
+    cache_config config;
+    cache* c;
+    int i;
+
+    if (!parse_cache_config(spec, &config)) {
+        return NULL;
+    }
+    c = calloc(1, sizeof(cache));
+    if (c != NULL) {
+        c->tags = malloc((size_t)config.sets * config.ways * sizeof(int));
+        c->stamps = calloc((size_t)config.sets * config.ways, sizeof(uint64_t));
+    }
+    if (c == NULL || c->tags == NULL || c->stamps == NULL) {
+        printf("An Error Has Occurred With The Cache\n");
+        exit(1);
+    }
+    c->config = config;
+    for (i = 0; i < config.sets * config.ways; i++) {
+        c->tags[i] = -1;
+    }
+    c->random_state = 1;
+    return c;
+}
+
+void free_cache(cache* c) {
+    if (c != NULL) {
+        free(c->tags);
+        free(c->stamps);
+        free(c);
+    }
+}
+
+/* looks up the word at address, filling its line on a miss. returns the cycles the access adds to a hit */
+int cache_access(cache* c, int address, bool write) {
+    int line = address / c->config.line_words, set = line & (c->config.sets - 1), i, victim = 0;
+    int* tags = &c->tags[set * c->config.ways];
+    uint64_t* stamps = &c->stamps[set * c->config.ways];
+
+    c->time++;
+    c->accesses[write]++;
+    for (i = 0; i < c->config.ways; i++) {
+        if (tags[i] == line) {
+            if (c->config.policy == CACHE_LRU) {
+                stamps[i] = c->time;
+            }
+            return 0;
+        }
+    }
+
+    c->misses[write]++;
+    if (c->config.policy == CACHE_RANDOM) {
+        c->random_state = c->random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        victim = (int)((c->random_state >> 33) % c->config.ways);
+    }
+    for (i = 0; i < c->config.ways; i++) {
+        if (tags[i] == -1) { /* an empty way is always filled first */
+            victim = i;
+            break;
+        }
+        if (c->config.policy != CACHE_RANDOM && stamps[i] < stamps[victim]) {
+            victim = i;
+        }
+    }
+    tags[victim] = line;
+    stamps[victim] = c->time;
+    return c->config.miss_penalty;
+}
+
+/* the value of a register as the instruction will see it, with $imm loaded */
+int operand_value(decoded_instruction* decoded, int* registers, int reg) {
+    return reg == IMM_REG ? decoded->imm : registers[reg];
+}
+
+/* called before the instruction at PC runs. runs its fetches and memory access through the caches and returns the
+   cycles their misses add */
+int cache_model_step(cache_model* caches, decoded_instruction* decoded, int PC, int* registers) {
+    int cycles = 0, address;
+
+    if (caches->icache != NULL) {
+        cycles += cache_access(caches->icache, PC, false);
+        if (decoded->is_immediate) {
+            cycles += cache_access(caches->icache, (PC + 1) & (MAIN_MEMORY_DEPTH - 1), false);
+        }
+    }
+    if (caches->dcache != NULL && (decoded->opcode == 16 || decoded->opcode == 17)) { /* lw, sw */
+        address = mod(operand_value(decoded, registers, decoded->rs) + operand_value(decoded, registers, decoded->rt), MAIN_MEMORY_DEPTH);
+        cycles += cache_access(caches->dcache, address, decoded->opcode == 17);
+    }
+    caches->stall_cycles += cycles;
+    return cycles;
+}
+
+/* writes a cache and its counts to the cache statistics */
+void write_cache_stats(FILE* stats_file, char* name, cache* c, char* reads) {
+    static char* policies[] = { "lru", "fifo", "random" };
+    long long accesses = c->accesses[0] + c->accesses[1], misses = c->misses[0] + c->misses[1];
+
+    fprintf(stats_file, "%s: %d sets, %d ways, %d words per line, %s, %d cycles per miss\n", name, c->config.sets, c->config.ways,
+        c->config.line_words, policies[c->config.policy], c->config.miss_penalty);
+    fprintf(stats_file, "%s %lld, misses %lld\n", reads, c->accesses[0], c->misses[0]);
+    if (c->accesses[1] > 0) {
+        fprintf(stats_file, "writes %lld, misses %lld\n", c->accesses[1], c->misses[1]);
+    }
+    fprintf(stats_file, "miss rate %.2f%%\n", accesses > 0 ? 100.0 * misses / accesses : 0.0);
+}
+
+/* writes the cache statistics of a run that took clock_cycle_counter cycles */
+void write_cache_model_stats(cache_model* caches, int clock_cycle_counter, char* stats_filename) {
+    FILE* stats_file = fopen(stats_filename, "w");
+
+    open_file_check(stats_filename, stats_file);
+    if (caches->icache != NULL) {
+        write_cache_stats(stats_file, "icache", caches->icache, "fetches");
+    }
+    if (caches->dcache != NULL) {
+        write_cache_stats(stats_file, "dcache", caches->dcache, "reads");
+    }
+    fprintf(stats_file, "miss cycles %lld of %d cycles\n", caches->stall_cycles, clock_cycle_counter);
+    fclose(stats_file);
+}
+
+void free_cache_model(cache_model* caches) {
+    if (caches != NULL) {
+        free_cache(caches->icache);
+        free_cache(caches->dcache);
+        free(caches);
+    }
+}
+
+/**************************************************************/
+/************************ pipeline model **********************/
+/**************************************************************/
+
+/* -pipeline times the program on a classic 5-stage pipeline (fetch, decode, execute, memory, write back) next to the
+   fixed cost model. it only watches the instructions the engine runs and counts its own cycles, so the clock, and
+   with it every result of the program, stays as it is. an instruction enters execute a cycle after the one before
+   it, unless it has to wait:
+   - for the fetch of its $imm word, a cycle.
+   - for a register it reads in execute (rs, rt, and rd of a branch). results are forwarded to the next instruction,
+     except for lw and in, whose result is only there after memory: the next instruction stalls a cycle (load-use).
+     sw and out read rd in memory, so they can take a loaded value without stalling.
+   - after a control transfer. the pipeline fetches on as if nothing happened, so a taken branch, jal or reti, and an
+     interrupt, flush the PIPELINE_FLUSH_PENALTY instructions fetched after them.
+   idle loops are run rather than skipped so that every iteration is timed, and the JIT gives way to the threaded
+   engine */
+
+#define PIPELINE_FLUSH_PENALTY 2               /* control transfers are resolved in execute */
+#define PIPELINE_FILL_CYCLES 2                 /* fetch and decode of the first instruction */
+#define PIPELINE_DRAIN_CYCLES 2                /* memory and write back of the last instruction */
+
+/* kinds of control transfers */
+#define FLUSH_BRANCH 0
+#define FLUSH_JAL 1
+#define FLUSH_RETI 2
+#define FLUSH_INTERRUPT 3
+#define NUM_OF_FLUSH_KINDS 4
+
+typedef struct {
+    long long execute_cycle;                  /* the cycle in which the last instruction was in execute */
+    long long ready[NUM_OF_REGISTERS];        /* the first cycle in which an instruction in execute can have the register */
+    int expected_PC;                          /* where the last instruction went, -1 before the first */
+    int pending_flush;                        /* the kind of control transfer of the last instruction, -1 if none */
+    long long instructions;
+    long long imm_fetch_cycles, load_use_cycles;
+    long long flushes[NUM_OF_FLUSH_KINDS];
+} pipeline_model;
+
+pipeline_model* create_pipeline_model(void) {
+    pipeline_model* pipeline = calloc(1, sizeof(pipeline_model));
+    if (pipeline == NULL) {
+        printf("An Error Has Occurred With The Pipeline Model\n");
+        exit(1);
+    }
+    pipeline->execute_cycle = PIPELINE_FILL_CYCLES;
+    pipeline->expected_PC = -1;
+    pipeline->pending_flush = -1;
+    return pipeline;
+}
+
+/* the earliest cycle in which an instruction may be in execute, given a register it reads in execute */
+long long pipeline_operand_cycle(pipeline_model* pipeline, long long cycle, int reg) {
+    return reg > IMM_REG && pipeline->ready[reg] > cycle ? pipeline->ready[reg] : cycle;
+}
+
+/* called after the instruction at PC ran, before the devices and the interrupts are updated. next_PC is where the
+   instruction went. mispredicted is the verdict of the branch predictor on it, NULL without one */
+void pipeline_step(pipeline_model* pipeline, decoded_instruction* decoded, int PC, int next_PC, bool* mispredicted) {
+    int opcode = decoded->opcode, fallthrough = PC + (decoded->is_immediate ? 2 : 1);
+    long long cycle = pipeline->execute_cycle + 1, fetched;
+
+    /* an instruction that isn't where the last one went was reached by an interrupt */
+    if (pipeline->expected_PC >= 0 && PC != pipeline->expected_PC) {
+        pipeline->pending_flush = FLUSH_INTERRUPT;
+    }
+    if (pipeline->pending_flush >= 0) {
+        pipeline->flushes[pipeline->pending_flush]++;
+        cycle += PIPELINE_FLUSH_PENALTY;
+        pipeline->pending_flush = -1;
+    }
+    if (decoded->is_immediate) {
+        pipeline->imm_fetch_cycles++;
+        cycle++;
+    }
+
+    fetched = cycle;
+    if (opcode <= MAX_OPCODE_NUM && opcode != 18 && opcode != 21) { /* all but reti, halt and invalid opcodes read rs and rt */
+        cycle = pipeline_operand_cycle(pipeline, cycle, decoded->rs);
+        if (opcode != 15) { /* jal */
+            cycle = pipeline_operand_cycle(pipeline, cycle, decoded->rt);
+        }
+    }
+    if (opcode >= 9 && opcode <= 14) { /* branches read rd in execute */
+        cycle = pipeline_operand_cycle(pipeline, cycle, decoded->rd);
+    }
+    else if (opcode == 17 || opcode == 20) { /* sw and out read rd in memory, a cycle later */
+        cycle = pipeline_operand_cycle(pipeline, cycle + 1, decoded->rd) - 1;
+    }
+    pipeline->load_use_cycles += cycle - fetched;
+
+    if (decoded->rd > IMM_REG && (opcode <= 8 || opcode == 15 || opcode == 16 || opcode == 19)) {
+        pipeline->ready[decoded->rd] = cycle + (opcode == 16 || opcode == 19 ? 2 : 1); /* lw and in: after memory */
+    }
+    if (mispredicted != NULL ? *mispredicted : next_PC != fallthrough) {
+        pipeline->pending_flush = opcode == 15 ? FLUSH_JAL : opcode == 18 ? FLUSH_RETI : FLUSH_BRANCH;
+    }
+    pipeline->execute_cycle = cycle;
+    pipeline->expected_PC = next_PC;
+    pipeline->instructions++;
+}
+
+/* writes the cycles of the pipeline, where they went, and the clock of the fixed cost model to compare with */
+void write_pipeline_stats(pipeline_model* pipeline, int clock_cycle_counter, char* stats_filename) {
+    static char* kinds[NUM_OF_FLUSH_KINDS] = { "branch", "jal", "reti", "interrupt" };
+    FILE* stats_file = fopen(stats_filename, "w");
+    long long cycles = pipeline->instructions > 0 ? pipeline->execute_cycle + PIPELINE_DRAIN_CYCLES : 0;
+    int i;
+
+    open_file_check(stats_filename, stats_file);
+    fprintf(stats_file, "cycles %lld\n", cycles);
+    fprintf(stats_file, "instructions %lld\n", pipeline->instructions);
+    fprintf(stats_file, "cpi %.3f\n", pipeline->instructions > 0 ? (double)cycles / pipeline->instructions : 0.0);
+    fprintf(stats_file, "fill and drain cycles %d\n", pipeline->instructions > 0 ? PIPELINE_FILL_CYCLES + PIPELINE_DRAIN_CYCLES : 0);
+    fprintf(stats_file, "imm fetch cycles %lld\n", pipeline->imm_fetch_cycles);
+    fprintf(stats_file, "load-use stall cycles %lld\n", pipeline->load_use_cycles);
+    for (i = 0; i < NUM_OF_FLUSH_KINDS; i++) {
+        fprintf(stats_file, "%s flushes %lld, cycles %lld\n", kinds[i], pipeline->flushes[i], pipeline->flushes[i] * PIPELINE_FLUSH_PENALTY);
+    }
+    fprintf(stats_file, "fixed model cycles %d\n", clock_cycle_counter);
+    fclose(stats_file);
+}
+
+/**************************************************************/
+/*********************** branch predictor *********************/
+/**************************************************************/
+
+/* -predictor simulates a branch predictor on the control transfers the program runs: beq to bge, jal and reti. a
+   prediction is the address fetched after the instruction, and it is a misprediction if the instruction goes
+   elsewhere, which costs PIPELINE_FLUSH_PENALTY cycles. the predictors are given as name or name,entries (a power of
+   2, PREDICTOR_DEFAULT_ENTRIES if not given):
+   - static: a branch is taken iff it goes backwards (to its rd). jal and reti aren't predicted (the next word).
+   - bimodal: a 2 bit counter for every branch, indexed by its PC. jal and reti aren't predicted.
+   - gshare: the 2 bit counters are indexed by the PC xor the outcomes of the last branches. jal and reti aren't predicted.
+   - btb: a branch target buffer, a direct mapped table of the targets the instructions last went to, with a 2 bit
+     counter each. an instruction that is in it and whose counter says taken is predicted to go to its target.
+     this is the only predictor of jal and reti.
+   the direction predictors know the target of a branch they predict taken, as it is in rd when the branch is decoded.
+   with -pipeline the pipeline only flushes after a misprediction, instead of after every control transfer.
+   like -profile, it keeps idle loops from being skipped so that every iteration is predicted */
+
+#define PREDICTOR_STATIC 0
+#define PREDICTOR_BIMODAL 1
+#define PREDICTOR_GSHARE 2
+#define PREDICTOR_BTB 3
+#define PREDICTOR_DEFAULT_ENTRIES 1024
+#define PREDICTOR_MAX_ENTRIES (1 << 20)
+
+typedef struct {
+    int kind, entries;
+    uint8_t* counters;                        /* 2 bit counters, taken from 2 and up */
+    int* targets;                             /* btb: the target of every entry, -1 if empty */
+    int* tags;                                /* btb: the PC of every entry */
+    unsigned history;                         /* gshare: the outcomes of the last branches, 1 for taken */
+    bool mispredicted;                        /* true iff the last instruction was mispredicted */
+    long long executed[MAIN_MEMORY_DEPTH], mispredictions[MAIN_MEMORY_DEPTH];
+} branch_predictor;
+
+/* parses name or name,entries. returns false if it isn't valid */
+bool parse_predictor_spec(char* spec, int* kind, int* entries) {
+    char name[8];
+    int length = 0, end = 0;
+
+    *entries = PREDICTOR_DEFAULT_ENTRIES;
+    if (sscanf(spec, "%7[a-z]%n", name, &length) != 1) {
+        return false;
+    }
+    if (spec[length] == ',') {
+        if (sscanf(spec + length + 1, "%d%n", entries, &end) != 1) {
+            return false;
+        }
+        length += 1 + end;
+    }
+    if (spec[length] != '\0') {
+        return false;
+    }
+    if (strcmp(name, "static") == 0) {
+        *kind = PREDICTOR_STATIC;
+    }
+    else if (strcmp(name, "bimodal") == 0) {
+        *kind = PREDICTOR_BIMODAL;
+    }
+    else if (strcmp(name, "gshare") == 0) {
+        *kind = PREDICTOR_GSHARE;
+    }
+    else if (strcmp(name, "btb") == 0) {
+        *kind = PREDICTOR_BTB;
+    }
+    else {
+        return false;
+    }
+    return power_of_two(*entries) && *entries <= PREDICTOR_MAX_ENTRIES;
+}
+
+/* returns a predictor that didn't see any branch yet, or NULL if the spec isn't valid */
+branch_predictor* create_branch_predictor(char* spec) {
+    branch_predictor* predictor;
+    int kind, entries, i;
+
+    if (!parse_predictor_spec(spec, &kind, &entries)) {
+        return NULL;
+    }
+    predictor = calloc(1, sizeof(branch_predictor));
+    if (predictor != NULL) {
+        predictor->counters = malloc(entries);
+        predictor->targets = malloc(entries * sizeof(int));
+        predictor->tags = malloc(entries * sizeof(int));
+    }
+    if (predictor == NULL || predictor->counters == NULL || predictor->targets == NULL || predictor->tags == NULL) {
+        printf("An Error Has Occurred With The Branch Predictor\n");
+        exit(1);
+    }
+    predictor->kind = kind;
+    predictor->entries = entries;
+    memset(predictor->counters, 1, entries); /* weakly not taken */
+    for (i = 0; i < entries; i++) {
+        predictor->targets[i] = -1;
+        predictor->tags[i] = -1;
+    }
+    return predictor;
+}
+
+void free_branch_predictor(branch_predictor* predictor) {
+    if (predictor != NULL) {
+        free(predictor->counters);
+        free(predictor->targets);
+        free(predictor->tags);
+        free(predictor);
+    }
+}
+
+/* moves a 2 bit counter towards taken or not taken */
+void update_counter(uint8_t* counter, bool taken) {
+    if (taken && *counter < 3) {
+        (*counter)++;
+    }
+    else if (!taken && *counter > 0) {
+        (*counter)--;
+    }
+}
+
+/* called after the instruction at PC ran, before the devices and the interrupts are updated. next_PC is where it
+   went. sets predictor->mispredicted */
+void predictor_step(branch_predictor* predictor, decoded_instruction* decoded, int PC, int next_PC, int* registers) {
+    int opcode = decoded->opcode, fallthrough = PC + (decoded->is_immediate ? 2 : 1), predicted = fallthrough, entry;
+    int target = operand_value(decoded, registers, decoded->rd); /* where a branch goes if taken */
+    bool branch = opcode >= 9 && opcode <= 14, taken = next_PC != fallthrough;
+
+    predictor->mispredicted = false;
+    if (!branch && opcode != 15 && opcode != 18) { /* not beq to bge, jal or reti */
+        return;
+    }
+    switch (predictor->kind) {
+    case PREDICTOR_STATIC:
+        if (branch && target < PC) {
+            predicted = target;
+        }
+        break;
+    case PREDICTOR_BIMODAL:
+    case PREDICTOR_GSHARE:
+        if (branch) {
+            entry = (PC ^ (predictor->kind == PREDICTOR_GSHARE ? predictor->history : 0)) & (predictor->entries - 1);
+            if (predictor->counters[entry] >= 2) {
+                predicted = target;
+            }
+            update_counter(&predictor->counters[entry], taken);
+            predictor->history = (predictor->history << 1) | taken;
+        }
+        break;
+    case PREDICTOR_BTB:
+        entry = PC & (predictor->entries - 1);
+        if (predictor->tags[entry] == PC && predictor->counters[entry] >= 2) {
+            predicted = predictor->targets[entry];
+        }
+        if (predictor->tags[entry] != PC) { /* a new instruction replaces the one in the entry */
+            predictor->tags[entry] = PC;
+            predictor->counters[entry] = 1;
+        }
+        update_counter(&predictor->counters[entry], taken);
+        if (taken) {
+            predictor->targets[entry] = next_PC;
+        }
+        break;
+    }
+    predictor->executed[PC]++;
+    if (predicted != next_PC) {
+        predictor->mispredictions[PC]++;
+        predictor->mispredicted = true;
+    }
+}
+
+/* writes the predictions of every control transfer (executed, mispredicted and the accuracy, by PC) and the cycles
+   the mispredictions cost */
+void write_predictor_stats(branch_predictor* predictor, decoded_instruction* decoded_memory, char* stats_filename) {
+    static char* kinds[] = { "static", "bimodal", "gshare", "btb" };
+    static char* opcode_names[] = { "beq", "bne", "blt", "bgt", "ble", "bge", "jal", "lw", "sw", "reti" };
+    FILE* stats_file = fopen(stats_filename, "w");
+    long long executed = 0, mispredictions = 0;
+    int PC, opcode;
+
+    open_file_check(stats_filename, stats_file);
+    fprintf(stats_file, "# pc instruction executed mispredicted accuracy\n");
+    for (PC = 0; PC < MAIN_MEMORY_DEPTH; PC++) {
+        if (predictor->executed[PC] == 0) {
+            continue;
+        }
+        opcode = decoded_memory[PC].opcode;
+        fprintf(stats_file, "%03X %s %lld %lld %.2f%%\n", PC, opcode >= 9 && opcode <= 18 ? opcode_names[opcode - 9] : "?",
+            predictor->executed[PC], predictor->mispredictions[PC],
+            100.0 * (predictor->executed[PC] - predictor->mispredictions[PC]) / predictor->executed[PC]);
+        executed += predictor->executed[PC];
+        mispredictions += predictor->mispredictions[PC];
+    }
+    fprintf(stats_file, "# %s predictor, %d entries\n", kinds[predictor->kind], predictor->entries);
+    fprintf(stats_file, "# predictions %lld, mispredictions %lld, accuracy %.2f%%\n", executed, mispredictions,
+        executed > 0 ? 100.0 * (executed - mispredictions) / executed : 100.0);
+    fprintf(stats_file, "# misprediction penalty cycles %lld\n", mispredictions * PIPELINE_FLUSH_PENALTY);
+    fclose(stats_file);
+}
+
+/* the engines stop before an instruction that can't run: always when the PC left main memory, which has nothing
+   to fetch there, and when they are given a fault flag (fuzzing does) also when the word there isn't an instruction.
+   returns true in that case, setting *fault unless fault is NULL */
+bool fault_check(bool* fault, decoded_instruction* decoded_memory, int PC) {
+    bool outside = PC < 0 || PC >= MAIN_MEMORY_DEPTH;
+    if (fault == NULL) {
+        return outside;
+    }
+    *fault = outside || decoded_memory[PC].opcode > MAX_OPCODE_NUM;
+    return *fault;
+}
+
+/**************************************************************/
+/************************ threaded engine *********************/
+/**************************************************************/
+
+/* the threaded engine jumps from one instruction straight to the handler decode_instruction chose for the next one.
+   with gcc and clang this is a computed goto through handler_labels, other compilers go through the switch.
+   every handler starts with a prologue that loads $imm (only in the $imm variants), writes the trace line and
+   advances PC and the clock, and then does exactly the work of its instruction with no further checks */
+#ifdef __GNUC__
+#define THREADED_DISPATCH(handler) goto *handler_labels[handler]
+#else
+#define THREADED_DISPATCH(handler)
+#endif
+#define THREADED_HANDLER(opcode, variant, label) case HANDLERS_PER_OPCODE * (opcode) + (variant): label:
+#define REG_PROLOGUE \
+    update_trace(PC, main_memory[PC], registers, output); \
+    PC += 1; clock_cycle_counter += 1;
+#define IMM_PROLOGUE \
+    registers[IMM_REG] = decoded->imm; \
+    update_trace(PC, main_memory[PC], registers, output); \
+    PC += 2; clock_cycle_counter += 2;
+
+/* arithmetic instructions, which have variants that only advance PC when rd can't be changed */
+#define ALU_HANDLERS(opcode, name, expression) \
+    THREADED_HANDLER(opcode, HANDLER_REG, name##_reg) REG_PROLOGUE registers[decoded->rd] = (expression); goto step_done; \
+    THREADED_HANDLER(opcode, HANDLER_IMM, name##_imm) IMM_PROLOGUE registers[decoded->rd] = (expression); goto step_done; \
+    THREADED_HANDLER(opcode, HANDLER_REG_NOP, name##_reg_nop) REG_PROLOGUE goto step_done; \
+    THREADED_HANDLER(opcode, HANDLER_IMM_NOP, name##_imm_nop) IMM_PROLOGUE goto step_done;
+/* instructions without $zero/$imm special cases */
+#define PLAIN_HANDLERS(opcode, name, statement) \
+    THREADED_HANDLER(opcode, HANDLER_REG, name##_reg) REG_PROLOGUE statement; goto step_done; \
+    THREADED_HANDLER(opcode, HANDLER_IMM, name##_imm) IMM_PROLOGUE statement; goto step_done;
+#define BRANCH_HANDLERS(opcode, name, condition) \
+    PLAIN_HANDLERS(opcode, name, if (condition) { PC = registers[decoded->rd]; })
+
+#define RS_VALUE registers[decoded->rs]
+#define RT_VALUE registers[decoded->rt]
+#define IO_ACCESS io_access_event(scheduler, disk, io_registers, clock_cycle_before);
+#define IDLE_LOOP_CHECK \
+    skipped_cycles = idle_loop_check(idle, scheduler, irq2, decoded, registers, io_registers, *executing_ISR, \
+        (int)(decoded - decoded_memory), clock_cycle_before, &instructions, output); \
+    clock_cycle_before += skipped_cycles; clock_cycle_counter += skipped_cycles;
+
+/* execute the program from *PC until a halt instruction, until the clock reaches cycle_limit or until the PC is
+   *stop_PC (unless stop_PC is NULL) or before an instruction that can't run (see fault_check), with the same results as calling execute_instruction and update_devices in a loop.
+   the devices are updated through the scheduler. every instruction is counted in profile, runs through caches and is
+   timed by pipeline, and every control transfer is predicted by predictor, unless they are NULL */
+void run_threaded(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, uint8_t* monitor, irq2_events* irq2,
+    device_scheduler* scheduler, idle_loop_detector* idle, int* registers, int* io_registers, int* p_PC, int* p_clock_cycle_counter, long long* p_instructions, bool* executing_ISR,
+    bool* p_halt, int cycle_limit, int* stop_PC, bool* fault, profiler* profile, cache_model* caches, pipeline_model* pipeline,
+    branch_predictor* predictor, output_writer* output) {
+
+#ifdef __GNUC__
+#define LABELS_ALU(name) &&name##_reg, &&name##_imm, &&name##_reg_nop, &&name##_imm_nop
+#define LABELS_PLAIN(name) &&name##_reg, &&name##_imm, &&name##_reg, &&name##_imm
+    static void* handler_labels[NUM_OF_HANDLERS] = {
+        LABELS_ALU(add), LABELS_ALU(sub), LABELS_ALU(mul), LABELS_ALU(and), LABELS_ALU(or), LABELS_ALU(xor),
+        LABELS_ALU(sll), LABELS_ALU(sra), LABELS_ALU(srl),
+        LABELS_PLAIN(beq), LABELS_PLAIN(bne), LABELS_PLAIN(blt), LABELS_PLAIN(bgt), LABELS_PLAIN(ble), LABELS_PLAIN(bge),
+        LABELS_PLAIN(jal), LABELS_PLAIN(lw), LABELS_PLAIN(sw), LABELS_PLAIN(reti), LABELS_PLAIN(in), LABELS_PLAIN(out),
+        LABELS_PLAIN(halt), LABELS_PLAIN(invalid)
+    };
+#undef LABELS_ALU
+#undef LABELS_PLAIN
+#endif
+    /* the PC, clock and instruction count are kept in locals while running and stored back on return */
+    int PC = *p_PC, clock_cycle_counter = *p_clock_cycle_counter, clock_cycle_before, skipped_cycles;
+    long long instructions = *p_instructions;
+    bool halt = *p_halt;
+    decoded_instruction* decoded;
+
+    while (!halt && clock_cycle_counter < cycle_limit && (stop_PC == NULL || PC != *stop_PC) &&
+        !fault_check(fault, decoded_memory, PC)) {
+        clock_cycle_before = clock_cycle_counter;
+        instructions++;
+        decoded = &decoded_memory[PC];
+        if (caches != NULL) {
+            clock_cycle_counter += cache_model_step(caches, decoded, (int)(decoded - decoded_memory), registers);
+        }
+        THREADED_DISPATCH(decoded->handler);
+        switch (decoded->handler) {
+        ALU_HANDLERS(0, add, RS_VALUE + RT_VALUE)
+        ALU_HANDLERS(1, sub, RS_VALUE - RT_VALUE)
+        ALU_HANDLERS(2, mul, RS_VALUE * RT_VALUE)
+        ALU_HANDLERS(3, and, RS_VALUE & RT_VALUE)
+        ALU_HANDLERS(4, or, RS_VALUE | RT_VALUE)
+        ALU_HANDLERS(5, xor, RS_VALUE ^ RT_VALUE)
+        ALU_HANDLERS(6, sll, RS_VALUE << RT_VALUE)
+        ALU_HANDLERS(7, sra, RS_VALUE >> RT_VALUE)
+        ALU_HANDLERS(8, srl, (int)((unsigned)RS_VALUE >> RT_VALUE))
+        BRANCH_HANDLERS(9, beq, RS_VALUE == RT_VALUE)
+        BRANCH_HANDLERS(10, bne, RS_VALUE != RT_VALUE)
+        BRANCH_HANDLERS(11, blt, RS_VALUE < RT_VALUE)
+        BRANCH_HANDLERS(12, bgt, RS_VALUE > RT_VALUE)
+        BRANCH_HANDLERS(13, ble, RS_VALUE <= RT_VALUE)
+        BRANCH_HANDLERS(14, bge, RS_VALUE >= RT_VALUE)
+        PLAIN_HANDLERS(15, jal, jal_instruction(registers, &PC, decoded->rd, decoded->rs))
+        PLAIN_HANDLERS(16, lw, lw_instruction(registers, main_memory, decoded->rd, decoded->rs, decoded->rt, &clock_cycle_counter))
+        PLAIN_HANDLERS(17, sw, idle->armed = false; sw_instruction(registers, main_memory, decoded_memory, dirty, decoded->rd, decoded->rs, decoded->rt, &clock_cycle_counter))
+        PLAIN_HANDLERS(18, reti, IO_ACCESS reti_instruction(io_registers, &PC, executing_ISR))
+        PLAIN_HANDLERS(19, in, IDLE_LOOP_CHECK IO_ACCESS in_instruction(registers, io_registers, decoded->rd, decoded->rs, decoded->rt, clock_cycle_counter, output))
+        PLAIN_HANDLERS(20, out, idle->armed = false; IO_ACCESS out_instruction(registers, io_registers, decoded->rd, decoded->rs, decoded->rt, clock_cycle_counter,
+            output, monitor, dirty, disk))
+        PLAIN_HANDLERS(21, halt, halt = true)
+        PLAIN_HANDLERS(22, invalid, (void)0)
+        }
+    step_done:
+        if (profile != NULL) {
+            profile_step(profile, decoded, (int)(decoded - decoded_memory), PC, clock_cycle_counter - clock_cycle_before, *executing_ISR);
+        }
+        if (predictor != NULL) {
+            predictor_step(predictor, decoded, (int)(decoded - decoded_memory), PC, registers);
+        }
+        if (pipeline != NULL) {
+            pipeline_step(pipeline, decoded, (int)(decoded - decoded_memory), PC, predictor != NULL ? &predictor->mispredicted : NULL);
+        }
+        if (clock_cycle_counter >= next_event_cycle(scheduler)) {
+            scheduled_update_devices(scheduler, main_memory, decoded_memory, dirty, disk, irq2, io_registers,
+                clock_cycle_before, clock_cycle_counter, &PC, executing_ISR);
+        }
+    }
+    sync_devices(scheduler, disk, io_registers, clock_cycle_counter);
+    *p_PC = PC;
+    *p_clock_cycle_counter = clock_cycle_counter;
+    *p_instructions = instructions;
+    *p_halt = halt;
+}
+
+
+/**************************************************************/
+/*************************** JIT engine ***********************/
+/**************************************************************/
+
+/* the JIT engine translates basic blocks of the program to x86-64 code. a block runs from its first instruction to the
+   first branch or jal (included), or up to an instruction that needs the interpreter (excluded): reti, in, out and halt.
+   the guest registers are kept in the registers array (addressed through rbx) and the clock in r12d.
+   a block may only run when all of its cycles end before the next event in the device scheduler, so devices never
+   need to be updated inside a block. blocks jump straight to the next translated block, through a patched jmp when the
+   target is known at translation time and through the block table otherwise. the trace is not written in this mode */
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED
+#endif
+
+#ifdef JIT_SUPPORTED
+
+#define JIT_CODE_SIZE (8 * 1024 * 1024)        /* size of the buffer of translated code */
+#define JIT_MAX_BLOCK_LENGTH 64                /* maximal number of instructions in a block */
+#define JIT_MAX_INSTRUCTION_CODE 96            /* more than the number of bytes of code generated for one instruction */
+#define JIT_MAX_LINKS 65536                    /* maximal number of jmps waiting for the block they jump to */
+
+/* state shared between the dispatcher (run_jit) and the translated code. the translated code uses the offsets of the
+   first fields, so they must not be moved */
+typedef struct {
+    int* registers;                            /* rbx */
+    uint32_t* main_memory;                     /* r13 */
+    void** blocks;                             /* r15 */
+    int clock_cycle_counter;                   /* r12d. the clock when entering and when leaving the translated code */
+    int deadline;                              /* a block may only run if the clock at its end is at most this */
+    int PC;                                    /* the PC when leaving the translated code */
+    long long instructions;                    /* number of instructions the translated code ran */
+    int stop_PC;                               /* blocks end before this address, -1 if none */
+    bool stop_at_fault;                        /* blocks end before invalid instructions, which the engine stops at */
+
+    decoded_instruction* decoded_memory;
+    dirty_map* dirty;
+    void* block_table[MAIN_MEMORY_DEPTH];      /* translated block starting at each address, NULL if none */
+    bool untranslatable[MAIN_MEMORY_DEPTH];    /* true if the instruction at the address must be interpreted */
+    bool translated[MAIN_MEMORY_DEPTH];        /* true if the word is part of a translated block */
+    uint8_t* code;
+    size_t code_used;
+    size_t stubs_size;                         /* the code starts with enter, exit and dispatch, which are never flushed */
+    void (*enter)(void* context, void* block); /* calls the translated code */
+    uint8_t* exit_stub;                        /* leaves the translated code with the PC in eax */
+    uint8_t* dispatch_stub;                    /* jumps to the translated block of the PC in eax, or leaves if there is none */
+    int link_targets[JIT_MAX_LINKS];           /* jmps to blocks which were not translated yet, and the PC they jump to */
+    uint8_t* link_sites[JIT_MAX_LINKS];
+    int num_of_links;
+} jit_state;
+
+/* appends bytes of code to the code buffer */
+void jit_emit(jit_state* jit, const void* bytes, size_t length) {
+    memcpy(&jit->code[jit->code_used], bytes, length);
+    jit->code_used += length;
+}
+void jit_emit_byte(jit_state* jit, uint8_t byte) {
+    jit->code[jit->code_used++] = byte;
+}
+void jit_emit_int32(jit_state* jit, int32_t value) {
+    jit_emit(jit, &value, sizeof(value));
+}
+
+/* emits a rel32 jump or call field pointing to target */
+void jit_emit_rel32(jit_state* jit, uint8_t* target) {
+    jit_emit_int32(jit, (int32_t)(target - &jit->code[jit->code_used + 4]));
+}
+
+/* points the rel32 field emitted at field to target. the field isn't aligned, so it is written with memcpy */
+void jit_patch_rel32(uint8_t* field, uint8_t* target) {
+    int32_t rel32 = (int32_t)(target - (field + 4));
+    memcpy(field, &rel32, sizeof(rel32));
+}
+
+/* emits "op reg32, [rbx + 4 * guest_register]" where modrm_reg is the number of the x86 register */
+void jit_emit_guest_register_op(jit_state* jit, uint8_t opcode, int modrm_reg, int guest_register) {
+    jit_emit_byte(jit, opcode);
+    jit_emit_byte(jit, 0x43 | (modrm_reg << 3));
+    jit_emit_byte(jit, 4 * guest_register);
+}
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_EDX 2
+#define X86_ESI 6
+#define X86_MOV_LOAD 0x8b
+#define X86_MOV_STORE 0x89
+#define X86_ADD_LOAD 0x03
+#define X86_CMP_LOAD 0x3b
+
+/* emits "mov dword [rbx + 4 * guest_register], value" */
+void jit_emit_store_constant(jit_state* jit, int guest_register, int value) {
+    jit_emit_byte(jit, 0xc7);
+    jit_emit_byte(jit, 0x43);
+    jit_emit_byte(jit, 4 * guest_register);
+    jit_emit_int32(jit, value);
+}
+
+/* emits "add r12d, cycles; add qword [r14 + instructions], instructions" */
+void jit_emit_add_clock(jit_state* jit, int cycles, int instructions) {
+    static const uint8_t add_r12d[] = { 0x41, 0x81, 0xc4 };
+    jit_emit(jit, add_r12d, sizeof(add_r12d));
+    jit_emit_int32(jit, cycles);
+    jit_emit(jit, "\x49\x81\x86", 3);
+    jit_emit_int32(jit, offsetof(jit_state, instructions));
+    jit_emit_int32(jit, instructions);
+}
+
+/* emits code leaving the translated code with the given PC */
+void jit_emit_exit(jit_state* jit, int PC) {
+    jit_emit_byte(jit, 0xb8); /* mov eax, PC */
+    jit_emit_int32(jit, PC);
+    jit_emit_byte(jit, 0xe9); /* jmp exit_stub */
+    jit_emit_rel32(jit, jit->exit_stub);
+}
+
+/* emits a jump to the block at the given PC. if it wasn't translated yet, the jump goes to an exit which is replaced by
+   a jump to the block once it is translated */
+void jit_emit_jump_to_pc(jit_state* jit, int PC) {
+    if (PC < 0 || PC >= MAIN_MEMORY_DEPTH) {
+        jit_emit_exit(jit, PC);
+        return;
+    }
+    jit_emit_byte(jit, 0xe9); /* jmp rel32 */
+    if (jit->block_table[PC] != NULL) {
+        jit_emit_rel32(jit, jit->block_table[PC]);
+        return;
+    }
+    if (jit->num_of_links < JIT_MAX_LINKS) {
+        jit->link_targets[jit->num_of_links] = PC;
+        jit->link_sites[jit->num_of_links] = &jit->code[jit->code_used];
+        jit->num_of_links++;
+    }
+    jit_emit_int32(jit, 0);       /* jump to the exit right after the jmp */
+    jit_emit_exit(jit, PC);
+}
+
+/* emits the entry, exit and dispatch stubs at the start of the code buffer */
+void jit_emit_stubs(jit_state* jit) {
+    static const uint8_t enter[] = {
+        0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, /* push rbx, rbp, r12, r13, r14, r15 */
+        0x48, 0x83, 0xec, 0x08,                                     /* sub rsp, 8 (align the stack for calls) */
+        0x49, 0x89, 0xfe,                                           /* mov r14, rdi */
+    };
+    static const uint8_t leave[] = {
+        0x48, 0x83, 0xc4, 0x08,                                     /* add rsp, 8 */
+        0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, /* pop r15, r14, r13, r12, rbp, rbx */
+        0xc3                                                        /* ret */
+    };
+    static const uint8_t dispatch[] = {
+        0x3d, MAIN_MEMORY_DEPTH & 0xff, MAIN_MEMORY_DEPTH >> 8, 0, 0, /* cmp eax, MAIN_MEMORY_DEPTH */
+        0x0f, 0x83, 0x0f, 0, 0, 0,                                  /* jae exit (15 bytes below) */
+        0x49, 0x8b, 0x14, 0xc7,                                     /* mov rdx, [r15 + rax * 8] */
+        0x48, 0x85, 0xd2,                                           /* test rdx, rdx */
+        0x0f, 0x84, 0x02, 0, 0, 0,                                  /* jz exit (2 bytes below) */
+        0xff, 0xe2                                                  /* jmp rdx */
+    };
+
+    jit->enter = (void (*)(void*, void*))jit->code;
+    jit_emit(jit, enter, sizeof(enter));
+    jit_emit(jit, "\x49\x8b\x9e", 3);                               /* mov rbx, [r14 + registers] */
+    jit_emit_int32(jit, offsetof(jit_state, registers));
+    jit_emit(jit, "\x4d\x8b\xae", 3);                               /* mov r13, [r14 + main_memory] */
+    jit_emit_int32(jit, offsetof(jit_state, main_memory));
+    jit_emit(jit, "\x4d\x8b\xbe", 3);                               /* mov r15, [r14 + blocks] */
+    jit_emit_int32(jit, offsetof(jit_state, blocks));
+    jit_emit(jit, "\x45\x8b\xa6", 3);                               /* mov r12d, [r14 + clock_cycle_counter] */
+    jit_emit_int32(jit, offsetof(jit_state, clock_cycle_counter));
+    jit_emit(jit, "\xff\xe6", 2);                                   /* jmp rsi */
+
+    jit->dispatch_stub = &jit->code[jit->code_used];
+    jit_emit(jit, dispatch, sizeof(dispatch));
+
+    jit->exit_stub = &jit->code[jit->code_used];
+    jit_emit(jit, "\x41\x89\x86", 3);                               /* mov [r14 + PC], eax */
+    jit_emit_int32(jit, offsetof(jit_state, PC));
+    jit_emit(jit, "\x45\x89\xa6", 3);                               /* mov [r14 + clock_cycle_counter], r12d */
+    jit_emit_int32(jit, offsetof(jit_state, clock_cycle_counter));
+    jit_emit(jit, leave, sizeof(leave));
+    jit->stubs_size = jit->code_used;
+}
+
+/* throws away all the translated blocks */
+void jit_flush(jit_state* jit) {
+    memset(jit->block_table, 0, sizeof(jit->block_table));
+    memset(jit->untranslatable, 0, sizeof(jit->untranslatable));
+    memset(jit->translated, 0, sizeof(jit->translated));
+    jit->num_of_links = 0;
+    jit->code_used = jit->stubs_size;
+}
+
+/* throws away all the translated blocks if any of the words from address to address + length - 1 was translated */
+void jit_invalidate(jit_state* jit, int address, int length) {
+    int i;
+    for (i = 0; i < length; i++) {
+        if (jit->translated[mod(address + i, MAIN_MEMORY_DEPTH)]) {
+            jit_flush(jit);
+            return;
+        }
+    }
+}
+
+/* sw called from translated code. returns 1 if the stored word was translated, in which case all blocks are thrown away
+   and the translated code must be left right away */
+int jit_store(jit_state* jit, int address, int value) {
+    jit->main_memory[address] = value & MEMWORD_MASK;
+    redecode_main_memory(jit->main_memory, jit->decoded_memory, jit->dirty, address, 1);
+    if (jit->translated[address]) {
+        jit_flush(jit);
+        return 1;
+    }
+    return 0;
+}
+
+/* true iff the instruction can be part of a translated block */
+bool jit_translatable(decoded_instruction* decoded) {
+    return decoded->opcode < 18 || decoded->opcode > MAX_OPCODE_NUM; /* everything but reti, in, out and halt */
+}
+
+/* emits the code of a single arithmetic, lw or sw instruction. sw_cycles and sw_instructions are the number of cycles and
+   instructions of the block up to and including this instruction, next_PC the address of the next instruction */
+void jit_translate_instruction(jit_state* jit, decoded_instruction* decoded, int sw_cycles, int sw_instructions, int next_PC) {
+    static const uint8_t alu_ops[][3] = {
+        { 0x01, 0xc8 }, { 0x29, 0xc8 }, { 0x0f, 0xaf, 0xc1 }, { 0x21, 0xc8 }, { 0x09, 0xc8 }, { 0x31, 0xc8 },
+        { 0xd3, 0xe0 }, { 0xd3, 0xf8 }, { 0xd3, 0xe8 }   /* add, sub, imul, and, or, xor eax, ecx; shl, sar, shr eax, cl */
+    };
+    int opcode = decoded->opcode;
+
+    if (opcode <= 8) {
+        if (decoded->handler % HANDLERS_PER_OPCODE >= HANDLER_REG_NOP) {
+            return; /* rd can't be changed */
+        }
+        jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_EAX, decoded->rs);
+        jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_ECX, decoded->rt);
+        jit_emit(jit, alu_ops[opcode], opcode == 2 ? 3 : 2);
+        jit_emit_guest_register_op(jit, X86_MOV_STORE, X86_EAX, decoded->rd);
+    }
+    else if (opcode == 16) { /* lw */
+        jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_EAX, decoded->rs);
+        jit_emit_guest_register_op(jit, X86_ADD_LOAD, X86_EAX, decoded->rt);
+        jit_emit_byte(jit, 0x25); /* and eax, MAIN_MEMORY_DEPTH - 1 */
+        jit_emit_int32(jit, MAIN_MEMORY_DEPTH - 1);
+        jit_emit(jit, "\x41\x8b\x44\x85\x00", 5); /* mov eax, [r13 + rax * 4] */
+        jit_emit_guest_register_op(jit, X86_MOV_STORE, X86_EAX, decoded->rd);
+    }
+    else if (opcode == 17) { /* sw */
+        jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_ESI, decoded->rs);
+        jit_emit_guest_register_op(jit, X86_ADD_LOAD, X86_ESI, decoded->rt);
+        jit_emit(jit, "\x81\xe6", 2); /* and esi, MAIN_MEMORY_DEPTH - 1 */
+        jit_emit_int32(jit, MAIN_MEMORY_DEPTH - 1);
+        jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_EDX, decoded->rd);
+        jit_emit(jit, "\x4c\x89\xf7\x48\xb8", 5); /* mov rdi, r14; mov rax, jit_store */
+        {
+            int (*store)(jit_state*, int, int) = jit_store;
+            jit_emit(jit, &store, sizeof(store));
+        }
+        jit_emit(jit, "\xff\xd0\x85\xc0\x74", 5); /* call rax; test eax, eax; jz over the exit */
+        jit_emit_byte(jit, 7 + 11 + 10);
+        jit_emit_add_clock(jit, sw_cycles, sw_instructions);
+        jit_emit_exit(jit, next_PC);
+    }
+    /* invalid opcodes do nothing */
+}
+
+/* translates the block starting at PC. returns the block, or NULL if the instruction at PC can't be translated */
+void* jit_translate_block(jit_state* jit, int PC) {
+    static const uint8_t skip_if_not[6] = { 0x85, 0x84, 0x8d, 0x8e, 0x8f, 0x8c }; /* jne, je, jge, jle, jg, jl for beq..bge */
+    decoded_instruction* decoded;
+    uint8_t* block;
+    uint8_t* deadline_exit;
+    uint8_t* not_taken;
+    int address, cycles = 0, length = 0, i;
+    int block_cycles_field;
+
+    if (jit->code_used + JIT_MAX_BLOCK_LENGTH * JIT_MAX_INSTRUCTION_CODE > JIT_CODE_SIZE) {
+        jit_flush(jit); /* out of space, start over */
+    }
+
+    /* the block may only run if all of its cycles fit before the deadline:
+       lea eax, [r12 + cycles]; cmp eax, [r14 + deadline]; jg exit. the cycles are filled in at the end */
+    block = &jit->code[jit->code_used];
+    jit_emit(jit, "\x41\x8d\x84\x24", 4);
+    block_cycles_field = (int)jit->code_used;
+    jit_emit_int32(jit, 0);
+    jit_emit(jit, "\x41\x3b\x86", 3);
+    jit_emit_int32(jit, offsetof(jit_state, deadline));
+    jit_emit(jit, "\x0f\x8f", 2);
+    deadline_exit = &jit->code[jit->code_used];
+    jit_emit_int32(jit, 0);
+
+    for (address = PC; ; ) {
+        decoded = &jit->decoded_memory[address];
+        if (!jit_translatable(decoded) || length == JIT_MAX_BLOCK_LENGTH || address == jit->stop_PC ||
+            (jit->stop_at_fault && decoded->opcode > MAX_OPCODE_NUM) ||
+            address + (decoded->is_immediate ? 2 : 1) > MAIN_MEMORY_DEPTH) {
+            if (length == 0) {
+                jit->code_used = block - jit->code;
+                return NULL;
+            }
+            /* the block ends before this instruction */
+            jit_emit_add_clock(jit, cycles, length);
+            jit_emit_jump_to_pc(jit, address);
+            break;
+        }
+
+        jit->translated[address] = true;
+        if (decoded->is_immediate) {
+            jit->translated[address + 1] = true;
+            jit_emit_store_constant(jit, IMM_REG, decoded->imm);
+        }
+        cycles += decoded->is_immediate ? 2 : 1;
+        if (decoded->opcode == 16 || decoded->opcode == 17) {
+            cycles++; /* memory access */
+        }
+        length++;
+        address += decoded->is_immediate ? 2 : 1;
+
+        if (decoded->opcode >= 9 && decoded->opcode <= 14) { /* branches end the block */
+            jit_emit_add_clock(jit, cycles, length);
+            jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_EAX, decoded->rs);
+            jit_emit_guest_register_op(jit, X86_CMP_LOAD, X86_EAX, decoded->rt);
+            jit_emit_byte(jit, 0x0f);
+            jit_emit_byte(jit, skip_if_not[decoded->opcode - 9]);
+            not_taken = &jit->code[jit->code_used];
+            jit_emit_int32(jit, 0);
+            if (decoded->rd == IMM_REG) {
+                jit_emit_jump_to_pc(jit, decoded->imm);
+            }
+            else {
+                jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_EAX, decoded->rd);
+                jit_emit_byte(jit, 0xe9); /* jmp dispatch_stub */
+                jit_emit_rel32(jit, jit->dispatch_stub);
+            }
+            jit_patch_rel32(not_taken, &jit->code[jit->code_used]);
+            jit_emit_jump_to_pc(jit, address);
+            break;
+        }
+        if (decoded->opcode == 15) { /* jal ends the block */
+            jit_emit_add_clock(jit, cycles, length);
+            jit_emit_store_constant(jit, decoded->rd, address);
+            if (decoded->rs == IMM_REG && decoded->rd != IMM_REG) {
+                jit_emit_jump_to_pc(jit, decoded->imm);
+            }
+            else {
+                jit_emit_guest_register_op(jit, X86_MOV_LOAD, X86_EAX, decoded->rs);
+                jit_emit_byte(jit, 0xe9); /* jmp dispatch_stub */
+                jit_emit_rel32(jit, jit->dispatch_stub);
+            }
+            break;
+        }
+        jit_translate_instruction(jit, decoded, cycles, length, address);
+    }
+
+    /* the exit taken when the deadline doesn't allow running the block */
+    memcpy(&jit->code[block_cycles_field], &cycles, sizeof(cycles));
+    jit_patch_rel32(deadline_exit, &jit->code[jit->code_used]);
+    jit_emit_exit(jit, PC);
+
+    /* link the jmps that were waiting for this block */
+    for (i = 0; i < jit->num_of_links; i++) {
+        if (jit->link_targets[i] == PC) {
+            jit_patch_rel32(jit->link_sites[i], block);
+            jit->link_targets[i] = jit->link_targets[--jit->num_of_links];
+            jit->link_sites[i] = jit->link_sites[jit->num_of_links];
+            i--;
+        }
+    }
+    jit->block_table[PC] = block;
+    return block;
+}
+
+/* creates the JIT of a machine, with no translated code */
+jit_state* create_jit(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, int* registers) {
+    jit_state* jit = calloc(1, sizeof(jit_state));
+    if (jit == NULL) {
+        printf("An Error Has Occurred With The JIT Engine\n");
+        exit(1);
+    }
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        printf("An Error Has Occurred With The JIT Engine\n");
+        exit(1);
+    }
+    jit->registers = registers;
+    jit->main_memory = main_memory;
+    jit->blocks = jit->block_table;
+    jit->decoded_memory = decoded_memory;
+    jit->dirty = dirty;
+    jit->stop_PC = -1;
+    jit_emit_stubs(jit);
+    jit_flush(jit);
+    return jit;
+}
+#endif /* JIT_SUPPORTED */
+
+/* releases the JIT created by run_jit, if any */
+void free_jit(void* jit) {
+#ifdef JIT_SUPPORTED
+    if (jit != NULL) {
+        munmap(((jit_state*)jit)->code, JIT_CODE_SIZE);
+        free(jit);
+    }
+#endif
+}
+
+/* throws away the translated code of the JIT created by run_jit, if any, when it covers one of the words from
+   address to address + length - 1 */
+void invalidate_jit(void* jit, int address, int length) {
+#ifdef JIT_SUPPORTED
+    if (jit != NULL) {
+        jit_invalidate(jit, address, length);
+    }
+#endif
+}
+
+/* execute the program from *PC until a halt instruction, until the clock reaches cycle_limit or until the PC is
+   *stop_PC (unless stop_PC is NULL) or before an instruction that can't run (see fault_check), running translated blocks where possible and interpreting the other instructions. gives the same results as the other engines, except
+   that no trace is written. the JIT is created on the first call and kept in *p_jit with its translated code (the
+   caller throws it away with free_jit when main memory is loaded again).
+   on machines the JIT doesn't support, the threaded engine is used instead (also without trace) */
+void run_jit(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, uint8_t* monitor, irq2_events* irq2,
+    device_scheduler* scheduler, idle_loop_detector* idle, int* registers, int* io_registers, int* PC, int* clock_cycle_counter, long long* instructions, bool* executing_ISR,
+    bool* p_halt, int cycle_limit, int* stop_PC, bool* fault, void** p_jit, output_writer* output) {
+    output->trace_enabled = false;
+#ifdef JIT_SUPPORTED
+    jit_state* jit;
+    decoded_instruction* decoded;
+    void* block;
+    int clock_cycle_before, store_address = 0, disk_words_read;
+    bool halt = *p_halt;
+
+    if (*p_jit == NULL) {
+        *p_jit = create_jit(main_memory, decoded_memory, dirty, registers);
+    }
+    jit = *p_jit;
+    if (jit->stop_PC != (stop_PC != NULL && *stop_PC >= 0 && *stop_PC < MAIN_MEMORY_DEPTH ? *stop_PC : -1)) {
+        jit->stop_PC = stop_PC != NULL && *stop_PC >= 0 && *stop_PC < MAIN_MEMORY_DEPTH ? *stop_PC : -1;
+        jit_flush(jit); /* no block may run past the new stop_PC */
+    }
+    if (jit->stop_at_fault != (fault != NULL)) {
+        jit->stop_at_fault = fault != NULL;
+        jit_flush(jit);
+    }
+
+    while (!halt && *clock_cycle_counter < cycle_limit && (stop_PC == NULL || *PC != *stop_PC) &&
+        !fault_check(fault, decoded_memory, *PC)) {
+        clock_cycle_before = *clock_cycle_counter;
+
+        /* run translated code for as long as it can go without missing a device event. the iteration of a possible
+           idle loop is interpreted, so that sw and out instructions in it are seen */
+        if (!jit->untranslatable[*PC] &&
+            !(idle->armed && *clock_cycle_counter - idle->clock_cycle_counter <= IDLE_LOOP_MAX_CYCLES)) {
+            block = jit->block_table[*PC];
+            if (block == NULL) {
+                block = jit_translate_block(jit, *PC);
+            }
+            if (block == NULL) {
+                jit->untranslatable[*PC] = true;
+            }
+            else {
+                jit->clock_cycle_counter = *clock_cycle_counter;
+                jit->instructions = 0;
+                jit->deadline = (next_event_cycle(scheduler) < cycle_limit ? next_event_cycle(scheduler) : cycle_limit) - 1;
+                jit->enter(jit, block);
+                *PC = jit->PC;
+                *clock_cycle_counter = jit->clock_cycle_counter;
+                *instructions += jit->instructions;
+            }
+        }
+        if (*clock_cycle_counter != clock_cycle_before) {
+            continue; /* no device event was due while running, the scheduler counts the cycles */
+        }
+
+        /* interpret a single instruction, and throw away translated code that it or a disk read overwrites */
+        decoded = &decoded_memory[*PC];
+        if (decoded->opcode == 17) {
+            store_address = (decoded->is_immediate && decoded->rs == IMM_REG ? decoded->imm : registers[decoded->rs]) +
+                (decoded->is_immediate && decoded->rt == IMM_REG ? decoded->imm : registers[decoded->rt]);
+        }
+        if (decoded->opcode == 17 || decoded->opcode == 20) { /* sw, out */
+            idle->armed = false;
+        }
+        else if (decoded->opcode == 19) { /* in */
+            *clock_cycle_counter += idle_loop_check(idle, scheduler, irq2, decoded, registers, io_registers, *executing_ISR,
+                *PC, *clock_cycle_counter, instructions, output);
+            clock_cycle_before = *clock_cycle_counter;
+        }
+        (*instructions)++;
+        disk_words_read = disk->words_read;
+        if (decoded->opcode >= 18 && decoded->opcode <= 20) { /* reti, in, out */
+            io_access_event(scheduler, disk, io_registers, clock_cycle_before);
+        }
+        execute_instruction(main_memory, decoded_memory, dirty, disk, monitor, PC, registers, io_registers,
+            clock_cycle_counter, &halt, executing_ISR, output);
+        if (decoded->opcode == 17) {
+            jit_invalidate(jit, store_address, 1);
+        }
+        scheduled_update_devices(scheduler, main_memory, decoded_memory, dirty, disk, irq2, io_registers,
+            clock_cycle_before, *clock_cycle_counter, PC, executing_ISR);
+        if (disk->words_read != disk_words_read) {
+            jit_invalidate(jit, disk->read_address, disk->words_read - disk_words_read);
+        }
+    }
+    sync_devices(scheduler, disk, io_registers, *clock_cycle_counter);
+    *p_halt = halt;
+#else
+    run_threaded(main_memory, decoded_memory, dirty, disk, monitor, irq2, scheduler, idle, registers, io_registers,
+        PC, clock_cycle_counter, instructions, executing_ISR, p_halt, cycle_limit, stop_PC, fault, NULL, NULL, NULL, NULL, output);
+#endif
+}
+
+/* execute the program from *PC until a halt instruction, until the clock reaches cycle_limit or until the PC is
+   *stop_PC (unless stop_PC is NULL) or before an instruction that can't run (see fault_check), calling execute_instruction on every step.
+   every instruction is counted in profile, runs through caches and is timed by pipeline, and every control transfer
+   is predicted by predictor, unless they are NULL */
+void run_switch(uint32_t* main_memory, decoded_instruction* decoded_memory, dirty_map* dirty, disk_image* disk, uint8_t* monitor, irq2_events* irq2,
+    device_scheduler* scheduler, idle_loop_detector* idle, int* registers, int* io_registers, int* PC, int* clock_cycle_counter, long long* instructions, bool* executing_ISR,
+    bool* halt, int cycle_limit, int* stop_PC, bool* fault, profiler* profile, cache_model* caches, pipeline_model* pipeline,
+    branch_predictor* predictor, output_writer* output) {
+
+    while (!*halt && *clock_cycle_counter < cycle_limit && (stop_PC == NULL || *PC != *stop_PC) &&
+        !fault_check(fault, decoded_memory, *PC)) {
+        decoded_instruction* decoded = &decoded_memory[*PC];
+        int opcode = decoded->opcode;
+        if (opcode == 17 || opcode == 20) { /* sw, out */
+            idle->armed = false;
+        }
+        else if (opcode == 19) { /* in */
+            *clock_cycle_counter += idle_loop_check(idle, scheduler, irq2, decoded, registers, io_registers, *executing_ISR,
+                *PC, *clock_cycle_counter, instructions, output);
+        }
+        (*instructions)++;
+        int clock_cycle_before = *clock_cycle_counter;
+        if (opcode >= 18 && opcode <= 20) { /* reti, in, out */
+            io_access_event(scheduler, disk, io_registers, *clock_cycle_counter);
+        }
+        if (caches != NULL) {
+            *clock_cycle_counter += cache_model_step(caches, decoded, (int)(decoded - decoded_memory), registers);
+        }
+        execute_instruction(main_memory, decoded_memory, dirty, disk, monitor, PC, registers, io_registers,
+            clock_cycle_counter, halt, executing_ISR, output);
+        if (profile != NULL) {
+            profile_step(profile, decoded, (int)(decoded - decoded_memory), *PC, *clock_cycle_counter - clock_cycle_before, *executing_ISR);
+        }
+        if (predictor != NULL) {
+            predictor_step(predictor, decoded, (int)(decoded - decoded_memory), *PC, registers);
+        }
+        if (pipeline != NULL) {
+            pipeline_step(pipeline, decoded, (int)(decoded - decoded_memory), *PC, predictor != NULL ? &predictor->mispredicted : NULL);
+        }
+
+        scheduled_update_devices(scheduler, main_memory, decoded_memory, dirty, disk, irq2, io_registers,
+            clock_cycle_before, *clock_cycle_counter, PC, executing_ISR);
+    }
+    sync_devices(scheduler, disk, io_registers, *clock_cycle_counter);
+}
+
+/**************************************************************/
+/**************************** machine *************************/
+/**************************************************************/
+
+/* all the state of a simulated machine (the library interface is in machine.h).
+   what every instruction touches comes first, the big arrays after it */
+struct machine {
+    /* arrays of the regular and i/o registers */
+    int registers[NUM_OF_REGISTERS], io_registers[NUM_OF_IO_REGISTERS];
+
+    /* important status integers and booleans */
+    int PC, clock_cycle_counter;
+    long long instructions;                   /* number of instructions run */
+    bool executing_ISR, halt;
+
+    int engine;
+    device_scheduler scheduler;
+    idle_loop_detector idle;
+    irq2_events irq2;                         /* the cycles when irq2 is raised */
+    void* jit;                                /* the JIT engine and its translated code, NULL until run_jit runs */
+    bool stop_at_fault;                       /* true to stop before an instruction that can't run (see fault_check) */
+    bool fault;                               /* true iff the machine stopped at such an instruction */
+    dirty_map dirty;                          /* what the program wrote to memory, the disk and the monitor */
+    profiler* profile;                        /* counts of every PC, NULL unless machine_start_profile was called */
+    cache_model* caches;                      /* the caches, NULL unless machine_set_caches was called */
+    pipeline_model* pipeline;                 /* NULL unless machine_start_pipeline was called */
+    branch_predictor* predictor;              /* NULL unless machine_start_predictor was called */
+    disk_timing disk_timing;                  /* how long the commands of the disk take, kept by reset_machine */
+
+    /* array of words representing the main memory, the disk and the monitor framebuffer */
+    decoded_instruction decoded_memory[MAIN_MEMORY_DEPTH]; /* main memory decoded as instructions */
+    uint32_t main_memory[MAIN_MEMORY_DEPTH];
+    disk_image disk;
+    uint8_t monitor[MONITOR_PIXELS];
+
+    output_writer output;                     /* the files we update every iteration */
+};
+
+/* a machine with empty memory and disk, no irq2 events and zero registers */
+void reset_machine(machine* m) {
+    memset(m->main_memory, 0, sizeof(m->main_memory));
+    decode_main_memory(m->main_memory, m->decoded_memory);
+    memset(&m->disk, 0, sizeof(m->disk));
+    m->disk.timing = &m->disk_timing;
+    m->disk.duration = DISK_R_W_TIME;
+    initialize_monitor(m->monitor);
+    m->irq2.cycles = NULL;
+    m->irq2.count = 0;
+    m->irq2.next = 0;
+    m->irq2.raised = 0;
+    m->irq2.source = IRQ2_ARRAY;
+    m->irq2.reader = NULL;
+    initialize_registers(m->registers, m->io_registers);
+    m->PC = 0;
+    m->clock_cycle_counter = 0;
+    m->instructions = 0;
+    m->executing_ISR = false;
+    m->halt = false;
+    initialize_scheduler(&m->scheduler, &m->disk, &m->irq2, m->io_registers, m->clock_cycle_counter);
+    m->idle.armed = false;
+    m->jit = NULL;
+    m->fault = false;
+    memset(&m->dirty, 0, sizeof(m->dirty));
+    initialize_output(&m->output);
+}
+
+/* closes the files of the machine and frees what it allocated, leaving it empty */
+void release_machine(machine* m) {
+    /* close the file: trace, hwregtrace, leds, display7seg
+       free the disk image and the irq2 events */
+    close_files_and_free_memory(&m->output, &m->disk, &m->irq2);
+    free_jit(m->jit);
+    reset_machine(m);
+}
+
+machine* machine_init(int engine, int skip_idle_loops) {
+    machine* m = malloc(sizeof(machine));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->engine = engine;
+    m->idle.enabled = skip_idle_loops;
+    m->stop_at_fault = false;
+    m->profile = NULL;
+    m->caches = NULL;
+    m->pipeline = NULL;
+    m->predictor = NULL;
+    default_disk_timing(&m->disk_timing);
+    reset_machine(m);
+    return m;
+}
+
+void machine_load(machine* m, char* memin_filename, char* diskin_filename, char* irq2in_filename) {
+    release_machine(m);
+
+    /* load data from files: memin, diskin, irq2in. the monitor is black and the registers are zero */
+    m->dirty.memory_end = initialize_main_memory(m->main_memory, memin_filename);
+    decode_main_memory(m->main_memory, m->decoded_memory);
+    initialize_disk(&m->disk, diskin_filename);
+    open_irq2_events(&m->irq2, irq2in_filename);
+    initialize_scheduler(&m->scheduler, &m->disk, &m->irq2, m->io_registers, m->clock_cycle_counter);
+}
+
+void machine_open_output(machine* m, char* trace_filename, char* hwregtrace_filename, char* leds_filename,
+    char* display7seg_filename, int binary_trace, int async_output) {
+    close_output(&m->output);
+    open_output(&m->output, trace_filename, hwregtrace_filename, leds_filename, display7seg_filename, binary_trace, async_output);
+}
+
+void machine_close_output(machine* m) {
+    close_output(&m->output);
+}
+
+/* runs with the engine of the machine until it halts, the clock reaches clock_cycle_limit or the PC is *stop_PC.
+   a profiled or pipelined machine, or one with caches or a branch predictor, runs the threaded engine instead of the JIT */
+int run_machine(machine* m, int clock_cycle_limit, int* stop_PC) {
+    bool* fault = m->stop_at_fault ? &m->fault : NULL;
+    if (m->engine == ENGINE_THREADED || (m->engine == ENGINE_JIT && (m->profile != NULL || m->caches != NULL || m->pipeline != NULL ||
+        m->predictor != NULL))) {
+        run_threaded(m->main_memory, m->decoded_memory, &m->dirty, &m->disk, m->monitor, &m->irq2, &m->scheduler, &m->idle, m->registers, m->io_registers,
+            &m->PC, &m->clock_cycle_counter, &m->instructions, &m->executing_ISR, &m->halt, clock_cycle_limit, stop_PC, fault, m->profile, m->caches, m->pipeline,
+            m->predictor, &m->output);
+    }
+    else if (m->engine == ENGINE_JIT) {
+        run_jit(m->main_memory, m->decoded_memory, &m->dirty, &m->disk, m->monitor, &m->irq2, &m->scheduler, &m->idle, m->registers, m->io_registers,
+            &m->PC, &m->clock_cycle_counter, &m->instructions, &m->executing_ISR, &m->halt, clock_cycle_limit, stop_PC, fault, &m->jit, &m->output);
+    }
+    else {
+        run_switch(m->main_memory, m->decoded_memory, &m->dirty, &m->disk, m->monitor, &m->irq2, &m->scheduler, &m->idle, m->registers, m->io_registers,
+            &m->PC, &m->clock_cycle_counter, &m->instructions, &m->executing_ISR, &m->halt, clock_cycle_limit, stop_PC, fault, m->profile, m->caches, m->pipeline,
+            m->predictor, &m->output);
+    }
+    return m->halt;
+}
+
+int machine_run_until(machine* m, int clock_cycle_limit) {
+    return run_machine(m, clock_cycle_limit, NULL);
+}
+
+int machine_run_until_pc(machine* m, int PC, int clock_cycle_limit) {
+    return run_machine(m, clock_cycle_limit, &PC);
+}
+
+/* every instruction takes at least one cycle, so the engines stop after one. the JIT interprets it, since
+   no block fits before the limit */
+int machine_step(machine* m) {
+    return machine_run_until(m, m->clock_cycle_counter + 1);
+}
+
+void machine_dump(machine* m, char* memout_filename, char* regout_filename, char* cycles_filename,
+    char* diskout_filename, char* monitortxt_filename, char* monitorimg_filename) {
+    /* create the output files: memout, regout, monitor.txt, cycles */
+    create_memout(m->main_memory, m->dirty.memory_end, memout_filename);
+    create_regout(m->registers, regout_filename);
+    create_diskout(&m->disk, diskout_filename);
+    create_monitor_txt(m->monitor, m->dirty.monitor_end, monitortxt_filename);
+    if (monitorimg_filename != NULL) {
+        create_monitor_image(m->monitor, monitorimg_filename);
+    }
+    create_cycles(m->clock_cycle_counter, cycles_filename);
+}
+
+/* a snapshot file holds the state of a machine between two instructions: SNAPSHOT_MAGIC, a snapshot_header and then
+   main memory, the disk and the monitor as they are in memory. it is written in the byte order of the machine writing
+   it. the irq2 events themselves aren't in it, only how many of them were already raised */
+typedef struct {
+    char magic[SNAPSHOT_MAGIC_SIZE];
+    int registers[NUM_OF_REGISTERS];
+    int io_registers[NUM_OF_IO_REGISTERS];    /* including timercurrent and clockcyclecounter, synced to the clock */
+    int PC, clock_cycle_counter;
+    int executing_ISR, halt;
+    int disk_timer, disk_duration, disk_head_sector, disk_words_moved;
+    disk_queue disk_queue;
+    int irq2_next;                            /* the number of irq2 events raised */
+    long long instructions;
+} snapshot_header;
+
+int machine_save_snapshot(machine* m, char* snapshot_filename) {
+    FILE* snapshot_file;
+    snapshot_header header;
+    int sector;
+
+    /* every sector of the disk has to be resident to be written as is */
+    for (sector = 0; sector < DISK_SECTORS; sector++) {
+        load_disk_sector(&m->disk, sector);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    memcpy(header.registers, m->registers, sizeof(header.registers));
+    memcpy(header.io_registers, m->io_registers, sizeof(header.io_registers));
+    header.PC = m->PC;
+    header.clock_cycle_counter = m->clock_cycle_counter;
+    header.executing_ISR = m->executing_ISR;
+    header.halt = m->halt;
+    header.disk_timer = m->disk.timer;
+    header.disk_duration = m->disk.duration;
+    header.disk_head_sector = m->disk.head_sector;
+    header.disk_words_moved = m->disk.words_moved;
+    header.disk_queue = m->disk.queue;
+    header.irq2_next = m->irq2.raised;
+    header.instructions = m->instructions;
+
+    snapshot_file = fopen(snapshot_filename, "wb");
+    open_file_check(snapshot_filename, snapshot_file);
+    fwrite(&header, sizeof(header), 1, snapshot_file);
+    fwrite(m->main_memory, sizeof(m->main_memory), 1, snapshot_file);
+    fwrite(m->disk.words, sizeof(m->disk.words), 1, snapshot_file);
+    fwrite(m->monitor, sizeof(m->monitor), 1, snapshot_file);
+    fclose(snapshot_file);
+    return m->halt;
+}
+
+/* returns true iff the disk of a snapshot header is in a state it can get to: the queue is within its ring and the
+   timer and duration of the command aren't negative. the head sector and the words moved are clamped instead */
+bool snapshot_disk_check(snapshot_header* header) {
+    return header->disk_queue.head >= 0 && header->disk_queue.head < DISK_QUEUE_DEPTH &&
+        header->disk_queue.count >= 0 && header->disk_queue.count <= DISK_QUEUE_DEPTH &&
+        header->disk_timer >= 0 && header->disk_duration >= 0;
+}
+
+void machine_restore_snapshot(machine* m, char* snapshot_filename) {
+    FILE* snapshot_file = fopen(snapshot_filename, "rb");
+    snapshot_header header;
+
+    open_file_check(snapshot_filename, snapshot_file);
+    if (fread(&header, sizeof(header), 1, snapshot_file) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0 ||
+        !snapshot_disk_check(&header) ||
+        fread(m->main_memory, sizeof(m->main_memory), 1, snapshot_file) != 1 ||
+        fread(m->disk.words, sizeof(m->disk.words), 1, snapshot_file) != 1 ||
+        fread(m->monitor, sizeof(m->monitor), 1, snapshot_file) != 1) {
+        printf("Invalid Snapshot File %s\n", snapshot_filename);
+        exit(1);
+    }
+    fclose(snapshot_file);
+
+    memcpy(m->registers, header.registers, sizeof(m->registers));
+    memcpy(m->io_registers, header.io_registers, sizeof(m->io_registers));
+    m->PC = header.PC;
+    m->clock_cycle_counter = header.clock_cycle_counter;
+    m->executing_ISR = header.executing_ISR;
+    m->halt = header.halt;
+    m->instructions = header.instructions;
+    m->disk.timer = header.disk_timer;
+    m->disk.duration = header.disk_duration;
+    m->disk.head_sector = mod(header.disk_head_sector, DISK_SECTORS);
+    m->disk.words_moved = header.disk_words_moved >= 0 && header.disk_words_moved <= LINES_PER_SECTOR ? header.disk_words_moved : 0;
+    m->disk.queue = header.disk_queue;
+    memset(m->disk.resident, true, sizeof(m->disk.resident));
+    seek_irq2_events(&m->irq2, header.irq2_next);
+
+    /* everything derived from the restored state starts over, and -delta writes what changes from it */
+    decode_main_memory(m->main_memory, m->decoded_memory);
+    clear_dirty_map(&m->dirty);
+    m->dirty.memory_end = MAIN_MEMORY_DEPTH;
+    m->dirty.monitor_end = MONITOR_PIXELS;
+    initialize_scheduler(&m->scheduler, &m->disk, &m->irq2, m->io_registers, m->clock_cycle_counter);
+    m->idle.armed = false;
+    free_jit(m->jit);
+    m->jit = NULL;
+}
+
+int machine_halted(machine* m) {
+    return m->halt;
+}
+int machine_pc(machine* m) {
+    return m->PC;
+}
+int machine_clock_cycles(machine* m) {
+    return m->clock_cycle_counter;
+}
+long long machine_instructions(machine* m) {
+    return m->instructions;
+}
+int machine_register(machine* m, int reg_num) {
+    return m->registers[reg_num & (NUM_OF_REGISTERS - 1)];
+}
+int machine_io_register(machine* m, int io_reg_num) {
+    return m->io_registers[mod(io_reg_num, NUM_OF_IO_REGISTERS)];
+}
+int machine_memory_word(machine* m, int address) {
+    return m->main_memory[address & (MAIN_MEMORY_DEPTH - 1)];
+}
+
+void machine_start_profile(machine* m, char* symbols_filename) {
+    free_profiler(m->profile);
+    m->profile = create_profiler(symbols_filename);
+    m->idle.enabled = false; /* every iteration of an idle loop is counted */
+}
+
+void machine_write_profile(machine* m, char* profile_filename, char* folded_filename) {
+    write_profile(m->profile, profile_filename);
+    if (folded_filename != NULL) {
+        write_folded_profile(m->profile, folded_filename);
+    }
+}
+
+int machine_set_caches(machine* m, char* icache_spec, char* dcache_spec) {
+    cache_model* caches = calloc(1, sizeof(cache_model));
+    if (caches == NULL) {
+        printf("An Error Has Occurred With The Cache\n");
+        exit(1);
+    }
+    if ((icache_spec != NULL && (caches->icache = create_cache(icache_spec)) == NULL) ||
+        (dcache_spec != NULL && (caches->dcache = create_cache(dcache_spec)) == NULL)) {
+        free_cache_model(caches);
+        return 0;
+    }
+    free_cache_model(m->caches);
+    m->caches = caches;
+    m->idle.enabled = false; /* a later iteration of an idle loop may take fewer cycles than the first */
+    return 1;
+}
+
+void machine_write_cache_stats(machine* m, char* stats_filename) {
+    write_cache_model_stats(m->caches, m->clock_cycle_counter, stats_filename);
+}
+
+void machine_start_pipeline(machine* m) {
+    free(m->pipeline);
+    m->pipeline = create_pipeline_model();
+    m->idle.enabled = false; /* every iteration of an idle loop is timed */
+}
+
+void machine_write_pipeline_stats(machine* m, char* stats_filename) {
+    write_pipeline_stats(m->pipeline, m->clock_cycle_counter, stats_filename);
+}
+
+int machine_start_predictor(machine* m, char* predictor_spec) {
+    branch_predictor* predictor = create_branch_predictor(predictor_spec);
+    if (predictor == NULL) {
+        return 0;
+    }
+    free_branch_predictor(m->predictor);
+    m->predictor = predictor;
+    m->idle.enabled = false; /* every iteration of an idle loop is predicted */
+    return 1;
+}
+
+void machine_write_predictor_stats(machine* m, char* stats_filename) {
+    write_predictor_stats(m->predictor, m->decoded_memory, stats_filename);
+}
+
+int machine_set_disk_timing(machine* m, char* timing_spec) {
+    disk_timing timing;
+    if (!parse_disk_timing(timing_spec, &timing)) {
+        return 0;
+    }
+    m->disk_timing = timing; /* from the next command on */
+    return 1;
+}
+
+void machine_write_delta(machine* m, char* delta_filename) {
+    create_delta(&m->dirty, m->main_memory, &m->disk, m->monitor, delta_filename);
+}
+
+void machine_free(machine* m) {
+    release_machine(m);
+    free(m->pipeline);
+    free_branch_predictor(m->predictor);
+    free_profiler(m->profile);
+    free_cache_model(m->caches);
+    free(m);
+}
+
+/* go over instruction memory and execute the instructions of the program */
+void run_program(char* memin_filename, char* diskin_filename, char* irq2in_filename, char* memout_filename, char* regout_filename, char* trace_filename, char* hwregtrace_filename,
+    char* cycles_filename, char* leds_filename, char* display7seg_filename, char* diskout_filename, char* monitortxt_filename, char* monitorimg_filename,
+    int engine, bool skip_idle_loops, bool binary_trace, bool async_output,
+    char* snapshot_filename, int snapshot_at, int snapshot_value, char* restore_filename,
+    char* profile_filename, char* symbols_filename, char* folded_filename, char* icache_spec, char* dcache_spec, char* cachestats_filename,
+    char* pipeline_filename, char* predictor_spec, char* predictorstats_filename, char* disktiming_spec,
+    char* delta_filename) {
+
+    machine* m = machine_init(engine, skip_idle_loops);
+    if (m == NULL) {
+        printf("An Error Has Occurred With The Machine\n");
+        exit(1);
+    }
+    machine_load(m, memin_filename, diskin_filename, irq2in_filename);
+    if (restore_filename != NULL) { /* continue from the snapshot instead of starting from memin and diskin */
+        machine_restore_snapshot(m, restore_filename);
+    }
+    if (profile_filename != NULL) {
+        machine_start_profile(m, symbols_filename);
+    }
+    if (icache_spec != NULL || dcache_spec != NULL) {
+        machine_set_caches(m, icache_spec, dcache_spec); /* checked by main */
+    }
+    if (pipeline_filename != NULL) {
+        machine_start_pipeline(m);
+    }
+    if (predictor_spec != NULL) {
+        machine_start_predictor(m, predictor_spec); /* checked by main */
+    }
+    if (disktiming_spec != NULL) {
+        machine_set_disk_timing(m, disktiming_spec); /* checked by main */
+    }
+
+    /* opening (and checking) the files: trace, hwregtrace, leds, display7seg in write mode */
+    machine_open_output(m, trace_filename, hwregtrace_filename, leds_filename, display7seg_filename, binary_trace, async_output);
+
+    /* run up to the snapshot, if there is one, and from there on. only halt instruction will stop the program */
+    if (snapshot_filename != NULL) {
+        if (snapshot_at == SNAPSHOT_AT_CYCLE) {
+            machine_run_until(m, snapshot_value);
+        }
+        else if (snapshot_at == SNAPSHOT_AT_PC) {
+            machine_run_until_pc(m, snapshot_value, INT32_MAX);
+        }
+        else {
+            machine_run_until(m, INT32_MAX);
+        }
+        machine_save_snapshot(m, snapshot_filename);
+    }
+    machine_run_until(m, INT32_MAX);
+    /* a PC outside main memory stops the engines before the program halts */
+    if (!m->halt && (m->PC < 0 || m->PC >= MAIN_MEMORY_DEPTH)) {
+        printf("An Error Has Occurred With The PC %d, Outside Main Memory\n", m->PC);
+        machine_free(m);
+        exit(1);
+    }
+
+    machine_dump(m, memout_filename, regout_filename, cycles_filename, diskout_filename, monitortxt_filename, monitorimg_filename);
+    if (delta_filename != NULL) {
+        machine_write_delta(m, delta_filename);
+    }
+    if (profile_filename != NULL) {
+        machine_write_profile(m, profile_filename, folded_filename);
+    }
+    if (cachestats_filename != NULL && (icache_spec != NULL || dcache_spec != NULL)) {
+        machine_write_cache_stats(m, cachestats_filename);
+    }
+    if (pipeline_filename != NULL) {
+        machine_write_pipeline_stats(m, pipeline_filename);
+    }
+    if (predictorstats_filename != NULL && predictor_spec != NULL) {
+        machine_write_predictor_stats(m, predictorstats_filename);
+    }
+    machine_free(m);
+}
+
+/**************************************************************/
+/**************************** batch mode **********************/
+/**************************************************************/
+
+/* sim -batch manifest runs many programs in one process. every non-empty line of the manifest (except for lines
+   starting with #) is a job: the 12 file names sim takes, in the same order, optionally followed by the clock cycle
+   at which the job is stopped if it didn't halt yet. the jobs run on a pool of worker threads, one per core unless
+   -threads is given. each worker has a deque of jobs: it takes its own jobs from the bottom and, when it runs out,
+   steals from the top of the others'. every worker reuses a single machine for all the jobs it runs.
+   a job with a file that can't be opened isn't run, so that it doesn't stop the others, and shows as an error.
+   once all the jobs are done, a summary of the cycles, instructions and wall time of each job is printed */
+
+#define BATCH_FILES 12                         /* file names in a manifest line */
+#define BATCH_LINE_SIZE 4096                   /* max characters in a manifest line */
+#define MAX_BATCH_THREADS 256
+
+typedef struct {
+    char* filenames[BATCH_FILES];             /* memin, diskin, irq2in, memout, regout, trace, hwregtrace, cycles, leds,
+                                                 display7seg, diskout, monitor.txt */
+    int cycle_limit;                          /* INT32_MAX if the line has none */
+    char* failed_file;                        /* the first file of the job that can't be opened, NULL if there is none */
+    int clock_cycle_counter, PC;              /* the results of the job */
+    long long instructions;
+    double seconds;
+    bool halted;
+} batch_job;
+
+/* the jobs waiting for a worker, jobs[top] to jobs[bottom - 1] */
+typedef struct {
+    int* jobs;
+    int top, bottom;
+#ifdef SIM_THREADS
+    pthread_mutex_t lock;
+#endif
+} batch_deque;
+
+typedef struct {
+    batch_job* jobs;
+    int num_of_jobs;
+    batch_deque* deques;
+    int num_of_workers;
+    int engine;
+    bool skip_idle_loops, binary_trace;
+} batch_pool;
+
+typedef struct {
+    batch_pool* pool;
+    int index;
+} batch_worker;
+
+/* wall clock time in seconds */
+double wall_time(void) {
+#ifdef SIM_THREADS
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* returns the first file of a job that can't be opened, NULL if there is none. the inputs are opened for reading
+   (irq2in may be a generator instead) and the outputs for appending, so that they aren't cut before the job runs */
+char* batch_job_file_check(batch_job* job) {
+    irq2_generator generator;
+    FILE* file;
+    int i;
+
+    for (i = 0; i < BATCH_FILES; i++) {
+        if (i == 2 && irq2_generator_check(job->filenames[i])) {
+            if (!parse_irq2_generator(job->filenames[i], &generator)) {
+                return job->filenames[i];
+            }
+            continue;
+        }
+        file = fopen(job->filenames[i], i < 3 ? "r" : "a");
+        if (file == NULL) {
+            return job->filenames[i];
+        }
+        fclose(file);
+    }
+    return NULL;
+}
+
+/* reads the jobs of the manifest. returns the array of jobs (freed with free_batch_jobs) and their number in num_of_jobs */
+batch_job* read_batch_manifest(char* manifest_filename, int* num_of_jobs) {
+    FILE* manifest_file = fopen(manifest_filename, "r");
+    char line_buffer[BATCH_LINE_SIZE + 1];
+    char* tokens[BATCH_FILES + 2], * end;
+    batch_job* jobs = NULL;
+    int line_num = 0, count, capacity = 0, i;
+    long cycle_limit;
+
+    open_file_check(manifest_filename, manifest_file);
+    *num_of_jobs = 0;
+    while (fgets(line_buffer, BATCH_LINE_SIZE + 1, manifest_file)) {
+        line_num++;
+        if (empty_line_check(line_buffer) == 1 || line_buffer[strspn(line_buffer, " \t")] == '#') {
+            continue;
+        }
+        for (count = 0; count < BATCH_FILES + 2; count++) {
+            tokens[count] = strtok(count == 0 ? line_buffer : NULL, " \t\r\n");
+            if (tokens[count] == NULL) {
+                break;
+            }
+        }
+        cycle_limit = INT32_MAX;
+        if (count == BATCH_FILES + 1) {
+            cycle_limit = strtol(tokens[BATCH_FILES], &end, 10);
+        }
+        if ((count != BATCH_FILES && count != BATCH_FILES + 1) || (count == BATCH_FILES + 1 && (*end != '\0' || cycle_limit <= 0))) {
+            printf("Invalid Batch Manifest Line %d\n", line_num);
+            exit(1);
+        }
+
+        if (*num_of_jobs == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            jobs = realloc(jobs, capacity * sizeof(batch_job));
+            if (jobs == NULL) {
+                printf("An Error Has Occurred With File %s\n", manifest_filename);
+                exit(1);
+            }
+        }
+        for (i = 0; i < BATCH_FILES; i++) {
+            jobs[*num_of_jobs].filenames[i] = malloc(strlen(tokens[i]) + 1);
+            if (jobs[*num_of_jobs].filenames[i] == NULL) {
+                printf("An Error Has Occurred With File %s\n", manifest_filename);
+                exit(1);
+            }
+            strcpy(jobs[*num_of_jobs].filenames[i], tokens[i]);
+        }
+        jobs[*num_of_jobs].cycle_limit = (int)(cycle_limit > INT32_MAX ? INT32_MAX : cycle_limit);
+        jobs[*num_of_jobs].failed_file = batch_job_file_check(&jobs[*num_of_jobs]);
+        (*num_of_jobs)++;
+    }
+    fclose(manifest_file);
+    return jobs;
+}
+
+void free_batch_jobs(batch_job* jobs, int num_of_jobs) {
+    int i, j;
+    for (i = 0; i < num_of_jobs; i++) {
+        for (j = 0; j < BATCH_FILES; j++) {
+            free(jobs[i].filenames[j]);
+        }
+    }
+    free(jobs);
+}
+
+/* runs a job on the machine of a worker. trace and the other files are written by the worker itself */
+void run_batch_job(machine* m, batch_job* job, bool binary_trace) {
+    char** f = job->filenames;
+    double start = wall_time();
+
+    if (job->failed_file != NULL) { /* shown in the summary */
+        job->halted = false;
+        job->clock_cycle_counter = 0;
+        job->instructions = 0;
+        job->seconds = 0;
+        return;
+    }
+    machine_load(m, f[0], f[1], f[2]);
+    machine_open_output(m, f[5], f[6], f[8], f[9], binary_trace, false);
+    job->halted = machine_run_until(m, job->cycle_limit);
+    machine_dump(m, f[3], f[4], f[7], f[10], f[11], NULL);
+    machine_close_output(m);
+    job->clock_cycle_counter = machine_clock_cycles(m);
+    job->PC = machine_pc(m);
+    job->instructions = machine_instructions(m);
+    job->seconds = wall_time() - start;
+}
+
+/* takes the next job of the worker: the bottom of its own deque, or else the top of another worker's.
+   returns -1 if no job is left */
+int take_batch_job(batch_pool* pool, int index) {
+    batch_deque* deque;
+    int i, job = -1;
+
+    for (i = 0; i < pool->num_of_workers && job == -1; i++) {
+        deque = &pool->deques[(index + i) % pool->num_of_workers];
+#ifdef SIM_THREADS
+        pthread_mutex_lock(&deque->lock);
+#endif
+        if (deque->top < deque->bottom) {
+            job = i == 0 ? deque->jobs[--deque->bottom] : deque->jobs[deque->top++];
+        }
+#ifdef SIM_THREADS
+        pthread_mutex_unlock(&deque->lock);
+#endif
+    }
+    return job;
+}
+
+/* a worker thread. runs jobs until none is left */
+void* batch_worker_thread(void* arg) {
+    batch_worker* worker = arg;
+    batch_pool* pool = worker->pool;
+    machine* m = machine_init(pool->engine, pool->skip_idle_loops);
+    int job;
+
+    if (m == NULL) {
+        printf("An Error Has Occurred With The Machine\n");
+        exit(1);
+    }
+    while ((job = take_batch_job(pool, worker->index)) != -1) {
+        run_batch_job(m, &pool->jobs[job], pool->binary_trace);
+    }
+    machine_free(m);
+    return NULL;
+}
+
+/* prints the results of the jobs, in the order of the manifest. a job ended by halting, at its cycle limit, at a PC
+   outside main memory or, if it couldn't run, with an error, which is shown with the file it couldn't open */
+void print_batch_summary(batch_job* jobs, int num_of_jobs, double seconds) {
+    long long total_cycles = 0, total_instructions = 0;
+    int i, halted = 0, failed = 0;
+    char* end;
+
+    printf("%-6s %12s %14s %10s  %-6s %s\n", "job", "cycles", "instructions", "seconds", "end", "memin");
+    for (i = 0; i < num_of_jobs; i++) {
+        end = jobs[i].failed_file != NULL ? "error" : jobs[i].halted ? "halt" :
+            jobs[i].PC < 0 || jobs[i].PC >= MAIN_MEMORY_DEPTH ? "pc" : "limit";
+        printf("%-6d %12d %14lld %10.4f  %-6s %s\n", i + 1, jobs[i].clock_cycle_counter, jobs[i].instructions,
+            jobs[i].seconds, end, jobs[i].failed_file != NULL ? jobs[i].failed_file : jobs[i].filenames[0]);
+        total_cycles += jobs[i].clock_cycle_counter;
+        total_instructions += jobs[i].instructions;
+        halted += jobs[i].halted;
+        failed += jobs[i].failed_file != NULL;
+    }
+    printf("%-6s %12lld %14lld %10.4f  %d of %d jobs halted", "total", total_cycles, total_instructions, seconds, halted, num_of_jobs);
+    if (failed > 0) {
+        printf(", %d could not run", failed);
+    }
+    printf("\n");
+}
+
+/* runs the jobs of the manifest on num_of_threads workers (0 for one per core) */
+void run_batch(char* manifest_filename, int num_of_threads, int engine, bool skip_idle_loops, bool binary_trace) {
+    batch_pool pool;
+    batch_worker workers[MAX_BATCH_THREADS];
+    double start = wall_time();
+    int i, j;
+#ifdef SIM_THREADS
+    pthread_t threads[MAX_BATCH_THREADS];
+    int started;
+#endif
+
+    pool.jobs = read_batch_manifest(manifest_filename, &pool.num_of_jobs);
+    pool.engine = engine;
+    pool.skip_idle_loops = skip_idle_loops;
+    pool.binary_trace = binary_trace;
+#ifdef SIM_THREADS
+    if (num_of_threads <= 0) {
+        num_of_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#else
+    num_of_threads = 1; /* no threads, the jobs run one after the other */
+#endif
+    if (num_of_threads > pool.num_of_jobs) {
+        num_of_threads = pool.num_of_jobs;
+    }
+    if (num_of_threads > MAX_BATCH_THREADS) {
+        num_of_threads = MAX_BATCH_THREADS;
+    }
+    if (num_of_threads < 1) {
+        num_of_threads = 1;
+    }
+    pool.num_of_workers = num_of_threads;
+
+    /* every worker starts with an equal share of the jobs, in the order of the manifest */
+    pool.deques = malloc(num_of_threads * sizeof(batch_deque));
+    if (pool.deques == NULL) {
+        printf("An Error Has Occurred With The Batch\n");
+        exit(1);
+    }
+    for (i = 0; i < num_of_threads; i++) {
+        batch_deque* deque = &pool.deques[i];
+        deque->top = 0;
+        deque->bottom = 0;
+        deque->jobs = malloc((pool.num_of_jobs / num_of_threads + 1) * sizeof(int));
+        if (deque->jobs == NULL) {
+            printf("An Error Has Occurred With The Batch\n");
+            exit(1);
+        }
+        /* the bottom is taken first, so the jobs are pushed last to first */
+        for (j = (int)((long long)(i + 1) * pool.num_of_jobs / num_of_threads) - 1; j >= (int)((long long)i * pool.num_of_jobs / num_of_threads); j--) {
+            deque->jobs[deque->bottom++] = j;
+        }
+#ifdef SIM_THREADS
+        pthread_mutex_init(&deque->lock, NULL);
+#endif
+        workers[i].pool = &pool;
+        workers[i].index = i;
+    }
+
+#ifdef SIM_THREADS
+    for (started = 1; started < num_of_threads; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker_thread, &workers[started]) != 0) {
+            break; /* the workers that did start steal the jobs of the others */
+        }
+    }
+    batch_worker_thread(&workers[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    batch_worker_thread(&workers[0]);
+#endif
+
+    print_batch_summary(pool.jobs, pool.num_of_jobs, wall_time() - start);
+    for (i = 0; i < num_of_threads; i++) {
+#ifdef SIM_THREADS
+        pthread_mutex_destroy(&pool.deques[i].lock);
+#endif
+        free(pool.deques[i].jobs);
+    }
+    free(pool.deques);
+    free_batch_jobs(pool.jobs, pool.num_of_jobs);
+}
+
+/**************************************************************/
+/****************************** fuzzing ***********************/
+/**************************************************************/
+
+/* sim -fuzz corpus_dir memin diskin irq2in runs the program over and over from the same base state with mutated
+   inputs, looking for the inputs that make it crash or hang. an input is a text file in the corpus directory with
+   irq2in lines (the clock cycles at which irq2 is raised, so any irq2in file is an input) and "@address word" lines
+   (both hex) that write a word of main memory before the run. the base state is the program as loaded, or the
+   snapshot given with -restore, in which case the irq2 cycles before its clock are skipped.
+   every run takes an input of the corpus (irq2in when the directory has none), mutates it and runs it for at most
+   -fuzzcycles clock cycles from the base state. a run that stops before an instruction that can't run (see
+   fault_check) is a crash, and one that neither crashes nor halts is a hang. the first input that crashes or hangs
+   at each PC is written to the corpus directory as crash-<PC>.txt or hang-<PC>.txt, which aren't read as inputs.
+   -fuzzruns and -fuzzseed set the number of runs and the seed of the mutations.
+   between runs, only what the dirty map shows the last run wrote is copied back from the base state */
+
+#define FUZZ_MAX_EVENTS 256                    /* irq2 cycles in an input */
+#define FUZZ_MAX_POKES 64                      /* main memory words written by an input */
+#define FUZZ_RUNS 100000                       /* runs when there is no -fuzzruns */
+#define FUZZ_CYCLES 100000                     /* clock cycles a run may take when there is no -fuzzcycles */
+#define FUZZ_MAX_MUTATIONS 4                   /* mutations applied to the input of a run, at most */
+
+typedef struct {
+    int cycles[FUZZ_MAX_EVENTS];              /* clock cycles when irq2 is raised, in ascending order */
+    int num_of_cycles;
+    int addresses[FUZZ_MAX_POKES];            /* words of main memory written before the run, and their values */
+    uint32_t words[FUZZ_MAX_POKES];
+    int num_of_pokes;
+} fuzz_input;
+
+/* index of the lowest set bit of a non-zero word */
+int lowest_bit(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+/* moves the last irq2 cycle of the input down to its place, keeping the cycles in ascending order */
+void fuzz_sort_last_cycle(fuzz_input* input) {
+    int i, cycle = input->cycles[input->num_of_cycles - 1];
+    for (i = input->num_of_cycles - 1; i > 0 && input->cycles[i - 1] > cycle; i--) {
+        input->cycles[i] = input->cycles[i - 1];
+    }
+    input->cycles[i] = cycle;
+}
+
+/* reads an input file of the corpus. lines beyond FUZZ_MAX_EVENTS cycles or FUZZ_MAX_POKES words are ignored */
+void read_fuzz_input(char* input_filename, fuzz_input* input) {
+    FILE* input_file = fopen(input_filename, "r");
+    char line_buffer[MAX_LINE_SIZE + 1];
+    unsigned address, word;
+
+    open_file_check(input_filename, input_file);
+    memset(input, 0, sizeof(fuzz_input));
+    while (fgets(line_buffer, MAX_LINE_SIZE + 1, input_file)) {
+        if (empty_line_check(line_buffer) == 1) {
+            continue;
+        }
+        if (line_buffer[0] == '@') {
+            if (sscanf(line_buffer + 1, "%x %x", &address, &word) == 2 && input->num_of_pokes < FUZZ_MAX_POKES) {
+                input->addresses[input->num_of_pokes] = address % MAIN_MEMORY_DEPTH;
+                input->words[input->num_of_pokes++] = word & MEMWORD_MASK;
+            }
+        }
+        else if (input->num_of_cycles < FUZZ_MAX_EVENTS) {
+            input->cycles[input->num_of_cycles++] = atoi(line_buffer);
+            fuzz_sort_last_cycle(input);
+        }
+    }
+    fclose(input_file);
+}
+
+/* writes an input in the format read_fuzz_input reads */
+void write_fuzz_input(char* input_filename, fuzz_input* input) {
+    FILE* input_file = fopen(input_filename, "w");
+    int i;
+
+    open_file_check(input_filename, input_file);
+    for (i = 0; i < input->num_of_cycles; i++) {
+        fprintf(input_file, "%d\n", input->cycles[i]);
+    }
+    for (i = 0; i < input->num_of_pokes; i++) {
+        fprintf(input_file, "@%03X %05X\n", input->addresses[i], input->words[i]);
+    }
+    fclose(input_file);
+}
+
+/* reads the inputs in the corpus directory, except the crashes and hangs written there. returns the array of inputs
+   (freed by the caller) and their number in num_of_inputs */
+fuzz_input* read_fuzz_corpus(char* corpus_dirname, int* num_of_inputs) {
+    fuzz_input* inputs = NULL;
+    char filename[MAX_LINE_SIZE + 1];
+    char* name;
+    int capacity = 0;
+#ifdef _WIN32
+    struct _finddata_t entry;
+    intptr_t dir;
+    snprintf(filename, sizeof(filename), "%s/*", corpus_dirname);
+    dir = _findfirst(filename, &entry);
+    if (dir == -1) {
+        open_file_check(corpus_dirname, NULL);
+    }
+    do {
+        name = entry.name;
+        if (entry.attrib & _A_SUBDIR) {
+            continue;
+        }
+#else
+    DIR* dir = opendir(corpus_dirname);
+    struct dirent* entry;
+    struct stat status;
+    if (dir == NULL) {
+        open_file_check(corpus_dirname, NULL);
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        name = entry->d_name;
+        snprintf(filename, sizeof(filename), "%s/%s", corpus_dirname, name);
+        if (stat(filename, &status) != 0 || !S_ISREG(status.st_mode)) {
+            continue;
+        }
+#endif
+        if (name[0] == '.' || strncmp(name, "crash-", 6) == 0 || strncmp(name, "hang-", 5) == 0) {
+            continue;
+        }
+        if (*num_of_inputs == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            inputs = realloc(inputs, capacity * sizeof(fuzz_input));
+            if (inputs == NULL) {
+                printf("An Error Has Occurred With The Corpus\n");
+                exit(1);
+            }
+        }
+        snprintf(filename, sizeof(filename), "%s/%s", corpus_dirname, name);
+        read_fuzz_input(filename, &inputs[(*num_of_inputs)++]);
+#ifdef _WIN32
+    } while (_findnext(dir, &entry) == 0);
+    _findclose(dir);
+#else
+    }
+    closedir(dir);
+#endif
+    return inputs;
+}
+
+/* applies a random mutation to an input: an irq2 cycle is added (within cycle_window cycles of base_clock), removed
+   or moved, or a word written before the run is changed or added. new words go to addresses the corpus writes,
+   or sometimes to any address */
+void mutate_fuzz_input(fuzz_input* input, uint64_t* state, int base_clock, int cycle_window,
+    fuzz_input* corpus, int num_of_inputs) {
+    static const uint32_t interesting_words[] = { 0, 1, 0x7ffff, 0x80000, MEMWORD_MASK, LINES_PER_SECTOR, DISK_SECTORS };
+    int mutation = fuzz_random(state) % 6, i, cycle;
+    fuzz_input* other;
+
+    if (mutation >= 3 && mutation <= 4 && input->num_of_pokes == 0) {
+        mutation = 5;
+    }
+    if ((mutation == 1 || mutation == 2) && input->num_of_cycles == 0) {
+        mutation = 0;
+    }
+    switch (mutation) {
+    case 0: /* raise irq2 at another cycle */
+        if (input->num_of_cycles < FUZZ_MAX_EVENTS) {
+            input->cycles[input->num_of_cycles++] = base_clock + (int)(fuzz_random(state) % cycle_window);
+            fuzz_sort_last_cycle(input);
+        }
+        break;
+    case 1: /* don't raise irq2 at one of the cycles */
+        i = fuzz_random(state) % input->num_of_cycles;
+        memmove(&input->cycles[i], &input->cycles[i + 1], (input->num_of_cycles - i - 1) * sizeof(int));
+        input->num_of_cycles--;
+        break;
+    case 2: /* raise irq2 a little earlier or later */
+        i = fuzz_random(state) % input->num_of_cycles;
+        cycle = input->cycles[i] + (int)(fuzz_random(state) % 129) - 64;
+        memmove(&input->cycles[i], &input->cycles[i + 1], (input->num_of_cycles - i - 1) * sizeof(int));
+        input->cycles[input->num_of_cycles - 1] = cycle < 0 ? 0 : cycle;
+        fuzz_sort_last_cycle(input);
+        break;
+    case 3: /* flip a bit of a word */
+        i = fuzz_random(state) % input->num_of_pokes;
+        input->words[i] ^= 1 << (fuzz_random(state) % 20);
+        break;
+    case 4: /* replace a word by a value programs tend to check for */
+        i = fuzz_random(state) % input->num_of_pokes;
+        input->words[i] = interesting_words[fuzz_random(state) % (sizeof(interesting_words) / sizeof(interesting_words[0]))];
+        break;
+    case 5: /* write another word */
+        if (input->num_of_pokes < FUZZ_MAX_POKES) {
+            other = &corpus[fuzz_random(state) % num_of_inputs];
+            input->addresses[input->num_of_pokes] = other->num_of_pokes > 0 && fuzz_random(state) % 4 != 0 ?
+                other->addresses[fuzz_random(state) % other->num_of_pokes] : (int)(fuzz_random(state) % MAIN_MEMORY_DEPTH);
+            input->words[input->num_of_pokes++] = fuzz_random(state) & MEMWORD_MASK;
+        }
+        break;
+    }
+}
+
+/* brings the machine back to the base state and writes the words of the input: copies back what the dirty map marks,
+   clears it and restarts the devices from the base clock with the irq2 cycles of the input */
+void fuzz_reset(machine* m, machine* base, fuzz_input* input) {
+    uint64_t bits;
+    int i, index;
+
+    for (i = 0; i < MAIN_MEMORY_DEPTH / 64; i++) {
+        for (bits = m->dirty.memory[i]; bits != 0; bits &= bits - 1) {
+            index = i * 64 + lowest_bit(bits);
+            m->main_memory[index] = base->main_memory[index];
+            m->decoded_memory[index] = base->decoded_memory[index];
+            m->decoded_memory[mod(index - 1, MAIN_MEMORY_DEPTH)] = base->decoded_memory[mod(index - 1, MAIN_MEMORY_DEPTH)];
+            invalidate_jit(m->jit, index, 1);
+        }
+    }
+    for (i = 0; i < (DISK_SECTORS + 63) / 64; i++) {
+        for (bits = m->dirty.sectors[i]; bits != 0; bits &= bits - 1) {
+            index = (i * 64 + lowest_bit(bits)) * LINES_PER_SECTOR;
+            memcpy(&m->disk.words[index], &base->disk.words[index], LINES_PER_SECTOR * sizeof(uint32_t));
+        }
+    }
+    for (i = 0; i < MONITOR_PIXELS / 64; i++) {
+        for (bits = m->dirty.monitor[i]; bits != 0; bits &= bits - 1) {
+            index = i * 64 + lowest_bit(bits);
+            m->monitor[index] = base->monitor[index];
+        }
+    }
+    clear_dirty_map(&m->dirty);
+
+    memcpy(m->registers, base->registers, sizeof(m->registers));
+    memcpy(m->io_registers, base->io_registers, sizeof(m->io_registers));
+    m->PC = base->PC;
+    m->clock_cycle_counter = base->clock_cycle_counter;
+    m->instructions = base->instructions;
+    m->executing_ISR = base->executing_ISR;
+    m->halt = base->halt;
+    m->fault = false;
+    m->disk.timer = base->disk.timer;
+    m->disk.duration = base->disk.duration;
+    m->disk.head_sector = base->disk.head_sector;
+    m->disk.words_moved = base->disk.words_moved;
+    m->disk.queue = base->disk.queue;
+
+    for (i = 0; i < input->num_of_pokes; i++) {
+        m->main_memory[input->addresses[i]] = input->words[i];
+        redecode_main_memory(m->main_memory, m->decoded_memory, &m->dirty, input->addresses[i], 1);
+        invalidate_jit(m->jit, input->addresses[i], 1);
+    }
+    m->irq2.source = IRQ2_ARRAY;
+    m->irq2.cycles = input->cycles;
+    m->irq2.count = input->num_of_cycles;
+    for (m->irq2.next = 0; m->irq2.next < m->irq2.count && m->irq2.cycles[m->irq2.next] < m->clock_cycle_counter; m->irq2.next++);
+    m->irq2.raised = m->irq2.next;
+    initialize_scheduler(&m->scheduler, &m->disk, &m->irq2, m->io_registers, m->clock_cycle_counter);
+    m->idle.armed = false;
+}
+
+void run_fuzz(char* corpus_dirname, char* memin_filename, char* diskin_filename, char* irq2in_filename, char* restore_filename,
+    int engine, bool skip_idle_loops, long long num_of_runs, int fuzz_cycles, uint64_t seed) {
+    machine* m = machine_init(engine, skip_idle_loops), * base = malloc(sizeof(machine));
+    fuzz_input* corpus;
+    fuzz_input input;
+    irq2_events loaded_irq2;
+    char filename[MAX_LINE_SIZE + 1];
+    bool* crashed = calloc(MAIN_MEMORY_DEPTH + 1, sizeof(bool)), * hung = calloc(MAIN_MEMORY_DEPTH + 1, sizeof(bool));
+    long long run, crashes = 0, hangs = 0;
+    int num_of_inputs = 0, unique_crashes = 0, unique_hangs = 0, cycle_limit, mutations, i, PC;
+    uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1; /* xorshift can't start from 0 */
+    double start, seconds;
+
+    if (m == NULL || base == NULL || crashed == NULL || hung == NULL) {
+        printf("An Error Has Occurred With The Machine\n");
+        exit(1);
+    }
+    machine_load(m, memin_filename, diskin_filename, irq2in_filename);
+    if (restore_filename != NULL) {
+        machine_restore_snapshot(m, restore_filename);
+    }
+    corpus = read_fuzz_corpus(corpus_dirname, &num_of_inputs);
+    if (num_of_inputs == 0) {
+        corpus = malloc(sizeof(fuzz_input));
+        if (corpus == NULL) {
+            printf("An Error Has Occurred With The Corpus\n");
+            exit(1);
+        }
+        read_fuzz_input(irq2in_filename, corpus);
+        num_of_inputs = 1;
+    }
+
+    /* the base state has every sector of the disk resident, so a run only has to copy back the sectors it wrote */
+    for (i = 0; i < DISK_SECTORS; i++) {
+        load_disk_sector(&m->disk, i);
+    }
+    clear_dirty_map(&m->dirty);
+    m->stop_at_fault = true;
+    memcpy(base, m, sizeof(machine));
+    loaded_irq2 = m->irq2;
+    cycle_limit = base->clock_cycle_counter > INT32_MAX - fuzz_cycles ? INT32_MAX : base->clock_cycle_counter + fuzz_cycles;
+
+    start = wall_time();
+    for (run = 0; run < num_of_runs; run++) {
+        input = corpus[fuzz_random(&state) % num_of_inputs];
+        for (mutations = 1 + fuzz_random(&state) % FUZZ_MAX_MUTATIONS; mutations > 0; mutations--) {
+            mutate_fuzz_input(&input, &state, base->clock_cycle_counter, fuzz_cycles, corpus, num_of_inputs);
+        }
+        fuzz_reset(m, base, &input);
+        run_machine(m, cycle_limit, NULL);
+
+        /* PCs outside main memory share the last entry of crashed and hung */
+        PC = m->PC >= 0 && m->PC < MAIN_MEMORY_DEPTH ? m->PC : MAIN_MEMORY_DEPTH;
+        if (m->fault) {
+            crashes++;
+            if (!crashed[PC]) {
+                crashed[PC] = true;
+                unique_crashes++;
+                snprintf(filename, sizeof(filename), "%s/crash-%03X.txt", corpus_dirname, m->PC);
+                write_fuzz_input(filename, &input);
+            }
+        }
+        else if (!m->halt) {
+            hangs++;
+            if (!hung[PC]) {
+                hung[PC] = true;
+                unique_hangs++;
+                snprintf(filename, sizeof(filename), "%s/hang-%03X.txt", corpus_dirname, m->PC);
+                write_fuzz_input(filename, &input);
+            }
+        }
+    }
+    seconds = wall_time() - start;
+    printf("%lld runs in %.3f seconds (%.0f runs per second), %d inputs in the corpus\n", num_of_runs, seconds,
+        seconds > 0 ? num_of_runs / seconds : 0, num_of_inputs);
+    printf("%lld crashes at %d PCs, %lld hangs at %d PCs\n", crashes, unique_crashes, hangs, unique_hangs);
+
+    m->irq2 = loaded_irq2; /* the machine frees the events it loaded */
+    machine_free(m);
+    free(base);
+    free(corpus);
+    free(crashed);
+    free(hung);
+}
+
+#ifndef SIM_LIBRARY
+
+/******* main ********/
+int main(int argc, char* argv[]) {
+    
+    char* memin_filename, * diskin_filename, * irq2in_filename, * memout_filename, * regout_filename, * trace_filename, * hwregtrace_filename,
+        * cycles_filename, * leds_filename, * display7seg_filename, * diskout_filename, * monitortxt_filename, * monitorimg_filename = NULL;
+    char* manifest_filename = NULL, * snapshot_filename = NULL, * restore_filename = NULL, * corpus_dirname = NULL, * end;
+    char* profile_filename = NULL, * symbols_filename = NULL, * folded_filename = NULL;
+    char* icache_spec = NULL, * dcache_spec = NULL, * cachestats_filename = NULL, * pipeline_filename = NULL;
+    char* predictor_spec = NULL, * predictorstats_filename = NULL, * disktiming_spec = NULL, * delta_filename = NULL;
+    cache_config config;
+    disk_timing timing;
+    int predictor_kind, predictor_entries;
+    int engine = ENGINE_SWITCH, num_of_threads = 0, snapshot_at = SNAPSHOT_AT_HALT, snapshot_value = 0, fuzz_cycles = FUZZ_CYCLES;
+    long long fuzz_runs = FUZZ_RUNS, fuzz_seed = 1;
+    bool valid_options = true, skip_idle_loops = true, binary_trace = false, async_output = true;
+
+    /* options come before the file names: -engine switch|threaded|jit, -idleloops skip|run, -trace text|binary,
+       -output async|sync, -snapshot file [-snapshotat halt|cycle:n|pc:n], -restore file,
+       -profile file [-symbols file] [-folded file],
+       -icache sets,ways,line,policy,penalty, -dcache sets,ways,line,policy,penalty, -cachestats file, -pipeline file,
+       -predictor static|bimodal|gshare|btb[,entries], -predictorstats file, -disktiming overhead,seek,rotation,word[,dma],
+       -delta file.
+       irq2in can be a generator instead of a file: periodic:period[,first], bursty:period,length[,spacing] or
+       random:mean[,seed] (see parse_irq2_generator).
+       -batch manifest [-threads n] runs the jobs of the manifest instead of a single program.
+       -fuzz corpus_dir [-fuzzruns n] [-fuzzcycles n] [-fuzzseed n] memin diskin irq2in fuzzes the program */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-engine") == 0 && strcmp(argv[2], "switch") == 0) {
+            engine = ENGINE_SWITCH;
+        }
+        else if (strcmp(argv[1], "-engine") == 0 && strcmp(argv[2], "threaded") == 0) {
+            engine = ENGINE_THREADED;
+        }
+        else if (strcmp(argv[1], "-engine") == 0 && strcmp(argv[2], "jit") == 0) {
+            engine = ENGINE_JIT;
+        }
+        else if (strcmp(argv[1], "-idleloops") == 0 && (strcmp(argv[2], "skip") == 0 || strcmp(argv[2], "run") == 0)) {
+            skip_idle_loops = strcmp(argv[2], "skip") == 0;
+        }
+        else if (strcmp(argv[1], "-trace") == 0 && (strcmp(argv[2], "text") == 0 || strcmp(argv[2], "binary") == 0)) {
+            binary_trace = strcmp(argv[2], "binary") == 0;
+        }
+        else if (strcmp(argv[1], "-output") == 0 && (strcmp(argv[2], "async") == 0 || strcmp(argv[2], "sync") == 0)) {
+            async_output = strcmp(argv[2], "async") == 0;
+        }
+        else if (strcmp(argv[1], "-batch") == 0) {
+            manifest_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-threads") == 0 && atoi(argv[2]) > 0) {
+            num_of_threads = atoi(argv[2]);
+        }
+        else if (strcmp(argv[1], "-snapshot") == 0) {
+            snapshot_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-snapshotat") == 0 && strcmp(argv[2], "halt") == 0) {
+            snapshot_at = SNAPSHOT_AT_HALT;
+        }
+        else if (strcmp(argv[1], "-snapshotat") == 0 && (strncmp(argv[2], "cycle:", 6) == 0 || strncmp(argv[2], "pc:", 3) == 0)) {
+            snapshot_at = argv[2][0] == 'c' ? SNAPSHOT_AT_CYCLE : SNAPSHOT_AT_PC;
+            snapshot_value = (int)strtol(strchr(argv[2], ':') + 1, &end, 0);
+            if (*end != '\0' || end == strchr(argv[2], ':') + 1) {
+                valid_options = false;
+                break;
+            }
+        }
+        else if (strcmp(argv[1], "-restore") == 0) {
+            restore_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-profile") == 0) {
+            profile_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-symbols") == 0) {
+            symbols_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-folded") == 0) {
+            folded_filename = argv[2];
+        }
+        else if ((strcmp(argv[1], "-icache") == 0 || strcmp(argv[1], "-dcache") == 0) && parse_cache_config(argv[2], &config)) {
+            if (argv[1][1] == 'i') {
+                icache_spec = argv[2];
+            }
+            else {
+                dcache_spec = argv[2];
+            }
+        }
+        else if (strcmp(argv[1], "-cachestats") == 0) {
+            cachestats_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-pipeline") == 0) {
+            pipeline_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-predictor") == 0 && parse_predictor_spec(argv[2], &predictor_kind, &predictor_entries)) {
+            predictor_spec = argv[2];
+        }
+        else if (strcmp(argv[1], "-predictorstats") == 0) {
+            predictorstats_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-disktiming") == 0 && parse_disk_timing(argv[2], &timing)) {
+            disktiming_spec = argv[2];
+        }
+        else if (strcmp(argv[1], "-delta") == 0) {
+            delta_filename = argv[2];
+        }
+        else if (strcmp(argv[1], "-fuzz") == 0) {
+            corpus_dirname = argv[2];
+        }
+        else if (strcmp(argv[1], "-fuzzruns") == 0 && atoll(argv[2]) > 0) {
+            fuzz_runs = atoll(argv[2]);
+        }
+        else if (strcmp(argv[1], "-fuzzcycles") == 0 && atoi(argv[2]) > 0) {
+            fuzz_cycles = atoi(argv[2]);
+        }
+        else if (strcmp(argv[1], "-fuzzseed") == 0) {
+            fuzz_seed = atoll(argv[2]);
+        }
+        else {
+            valid_options = false;
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (valid_options && manifest_filename != NULL && corpus_dirname == NULL && argc == 1) {
+        run_batch(manifest_filename, num_of_threads, engine, skip_idle_loops, binary_trace);
+    }
+    else if (valid_options && corpus_dirname != NULL && manifest_filename == NULL && argc == 4) {
+        run_fuzz(corpus_dirname, argv[1], argv[2], argv[3], restore_filename, engine, skip_idle_loops, fuzz_runs, fuzz_cycles,
+            (uint64_t)fuzz_seed);
+    }
+    /* the binary monitor image (monitor.yuv or a .pgm file) is an optional last argument */
+    else if (valid_options && manifest_filename == NULL && corpus_dirname == NULL && (argc == 13 || argc == 14)) {
+        memin_filename = argv[1];
+        diskin_filename = argv[2];
+        irq2in_filename = argv[3];
+        memout_filename = argv[4];
+        regout_filename = argv[5];
+        trace_filename = argv[6];
+        hwregtrace_filename = argv[7];
+        cycles_filename = argv[8];    
+        leds_filename = argv[9];      
+        display7seg_filename = argv[10]; 
+        diskout_filename = argv[11];     
+        monitortxt_filename = argv[12]; 
+        if (argc == 14) {
+            monitorimg_filename = argv[13];
+        }
         run_program(memin_filename, diskin_filename, irq2in_filename, memout_filename, regout_filename, trace_filename, hwregtrace_filename,
-            cycles_filename, leds_filename, display7seg_filename, diskout_filename, monitortxt_filename);
+            cycles_filename, leds_filename, display7seg_filename, diskout_filename, monitortxt_filename, monitorimg_filename, engine, skip_idle_loops, binary_trace, async_output,
+            snapshot_filename, snapshot_at, snapshot_value, restore_filename, profile_filename, symbols_filename, folded_filename,
+            icache_spec, dcache_spec, cachestats_filename, pipeline_filename, predictor_spec, predictorstats_filename,
+            disktiming_spec, delta_filename);
     }
     /* number of command line input arguments is invalid */
     else {
-        int i = 1;
         printf("Invalid Input Arguments\n");
         return 1;
     }
     
     return 0;
 }
+#endif /* SIM_LIBRARY */
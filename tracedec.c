@@ -0,0 +1,141 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_DEPRECATE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* tracedec turns the binary trace files written by sim -trace binary back into the text of trace.txt and
+   hwregtrace.txt. usage: tracedec <binary trace or hwregtrace> <text output file>
+   the kind of the input is told by its first bytes. the formats are described next to trace_writer in sim.c */
+
+/*************************************************/
+/**************** define constants ***************/
+/*************************************************/
+
+#define NUM_OF_REGISTERS 16                    /* number of registers */
+#define NUM_OF_IO_REGISTERS 23                 /* number of input-output registers */
+#define TRACE_MAGIC "SIMTRACE"                 /* start of a binary trace file */
+#define HWREGTRACE_MAGIC "SIMHWREG"            /* start of a binary hwregtrace file */
+#define TRACE_MAGIC_SIZE 8
+#define HWREGTRACE_RECORD_SIZE 9
+#define TRACE_BUFFER_SIZE (1 << 20)            /* size of the buffers of the files */
+
+/* names of the i/o registers as written to hwregtrace.txt */
+static const char* io_register_names[NUM_OF_IO_REGISTERS] = {
+    "irq0enable", "irq1enable", "irq2enable", "irq0status", "irq1status", "irq2status", "irqhandler", "irqreturn",
+    "clks", "leds", "display7seg", "timerenable", "timercurrent", "timermax", "diskcmd", "disksector", "diskbuffer",
+    "diskstatus", "diskqueue", "diskdone", "monitoraddr", "monitordata", "monitorcmd"
+};
+
+/*************************************************/
+/***************** functions *********************/
+/*************************************************/
+
+/* checks if a file was opened successfully and exits otherwise */
+void open_file_check(char* filename, FILE* file) {
+    if (file == NULL) {
+        printf("An Error Has Occurred With File %s\n", filename);
+        exit(1); /* terminates the program */
+    }
+}
+
+/* reads a little endian 16 or 32 bit number. returns 0 at the end of the file */
+int read_uint16(FILE* file, uint32_t* value) {
+    uint8_t bytes[2];
+    if (fread(bytes, 1, 2, file) != 2) {
+        return 0;
+    }
+    *value = bytes[0] | (bytes[1] << 8);
+    return 1;
+}
+int read_uint32(FILE* file, uint32_t* value) {
+    uint32_t low, high;
+    if (!read_uint16(file, &low) || !read_uint16(file, &high)) {
+        return 0;
+    }
+    *value = low | (high << 16);
+    return 1;
+}
+
+/* writes a trace line for every record of a binary trace */
+void decode_trace(FILE* binary_file, FILE* text_file) {
+    uint32_t header, changed, value;
+    int registers[NUM_OF_REGISTERS] = { 0 };
+    int i;
+
+    while (read_uint32(binary_file, &header)) {
+        if (!read_uint16(binary_file, &changed)) {
+            printf("Truncated Trace Record\n");
+            exit(1);
+        }
+        for (i = 0; i < NUM_OF_REGISTERS; i++) {
+            if (changed & (1 << i)) {
+                if (!read_uint32(binary_file, &value)) {
+                    printf("Truncated Trace Record\n");
+                    exit(1);
+                }
+                registers[i] = (int)value;
+            }
+        }
+
+        /* 3 digits for PC, 5 for the instruction and 8 for each register, as sim writes them */
+        fprintf(text_file, "%03X %05X", header >> 20, header & 0xfffff);
+        for (i = 0; i < NUM_OF_REGISTERS; i++) {
+            fprintf(text_file, " %08X", registers[i]);
+        }
+        fprintf(text_file, "\n");
+    }
+}
+
+/* writes a hwregtrace line for every record of a binary hwregtrace */
+void decode_hwregtrace(FILE* binary_file, FILE* text_file) {
+    uint8_t record[HWREGTRACE_RECORD_SIZE];
+    uint32_t clock_cycle_counter, value;
+    size_t size;
+
+    while ((size = fread(record, 1, HWREGTRACE_RECORD_SIZE, binary_file)) == HWREGTRACE_RECORD_SIZE) {
+        clock_cycle_counter = record[0] | (record[1] << 8) | (record[2] << 16) | ((uint32_t)record[3] << 24);
+        value = record[5] | (record[6] << 8) | (record[7] << 16) | ((uint32_t)record[8] << 24);
+        fprintf(text_file, "%d %s %s %08X\n", (int)clock_cycle_counter, (record[4] & 1) ? "WRITE" : "READ",
+            io_register_names[(record[4] >> 1) % NUM_OF_IO_REGISTERS], value);
+    }
+    if (size != 0) {
+        printf("Truncated Hwregtrace Record\n");
+        exit(1);
+    }
+}
+
+/******* main ********/
+int main(int argc, char* argv[]) {
+    FILE* binary_file, * text_file;
+    char magic[TRACE_MAGIC_SIZE] = { 0 };
+
+    if (argc != 3) {
+        printf("Invalid Input Arguments\n");
+        return 1;
+    }
+    binary_file = fopen(argv[1], "rb");
+    open_file_check(argv[1], binary_file);
+    text_file = fopen(argv[2], "w");
+    open_file_check(argv[2], text_file);
+    setvbuf(binary_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    setvbuf(text_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    fread(magic, 1, TRACE_MAGIC_SIZE, binary_file);
+    if (memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0) {
+        decode_trace(binary_file, text_file);
+    }
+    else if (memcmp(magic, HWREGTRACE_MAGIC, TRACE_MAGIC_SIZE) == 0) {
+        decode_hwregtrace(binary_file, text_file);
+    }
+    else {
+        printf("Not A Binary Trace File: %s\n", argv[1]);
+        return 1;
+    }
+
+    fclose(binary_file);
+    fclose(text_file);
+    return 0;
+}